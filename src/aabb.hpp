@@ -2,15 +2,17 @@
 #define AABB_H
 
 #include <climits>
+#include <limits>
 #include <algorithm>
 #include <glm/glm.hpp>
 
 // Axis Aligned Bounding Box
 struct AABB {
     AABB() {
-        x = std::make_pair(std::numeric_limits<float>::max(), std::numeric_limits<float>::min());
-        y = std::make_pair(std::numeric_limits<float>::max(), std::numeric_limits<float>::min());
-        z = std::make_pair(std::numeric_limits<float>::max(), std::numeric_limits<float>::min());
+        // NB: lowest() (not min(), which is the smallest positive float) so empty boxes grow correctly
+        x = std::make_pair(std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest());
+        y = std::make_pair(std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest());
+        z = std::make_pair(std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest());
     }
 
     void update(const glm::vec3 &p) {
@@ -22,6 +24,25 @@ struct AABB {
         z.second = std::max(z.second, p.z);
     }
 
+    void update(const AABB &b) {
+        x.first = std::min(x.first, b.x.first);
+        y.first = std::min(y.first, b.y.first);
+        z.first = std::min(z.first, b.z.first);
+        x.second = std::max(x.second, b.x.second);
+        y.second = std::max(y.second, b.y.second);
+        z.second = std::max(z.second, b.z.second);
+    }
+
+    bool empty() const { return x.first > x.second || y.first > y.second || z.first > z.second; }
+
+    // Surface area (used by SAH cost), empty box has no area
+    float area() const {
+        if (empty())
+            return 0;
+        auto dx = x.second - x.first, dy = y.second - y.first, dz = z.second - z.first;
+        return 2*(dx*dy + dy*dz + dz*dx);
+    }
+
     std::pair<float, float> x;
     std::pair<float, float> y;
     std::pair<float, float> z;
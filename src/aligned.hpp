@@ -0,0 +1,36 @@
+#ifndef ALIGNED_H
+#define ALIGNED_H
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Allocator for over-aligned types
+// NB: std::allocator ignores alignas beyond alignof(max_align_t) before C++17
+template <typename T, size_t Align>
+struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+    AlignedAllocator() { }
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Align> &) { }
+
+    T *allocate(size_t n) {
+        void *p = nullptr;
+        if (posix_memalign(&p, Align, n*sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+    void deallocate(T *p, size_t) { free(p); }
+};
+
+template <typename T, typename U, size_t Align>
+bool operator==(const AlignedAllocator<T, Align> &, const AlignedAllocator<U, Align> &) { return true; }
+
+template <typename T, typename U, size_t Align>
+bool operator!=(const AlignedAllocator<T, Align> &, const AlignedAllocator<U, Align> &) { return false; }
+
+template <typename T, size_t Align = alignof(T)>
+using aligned_vector = std::vector<T, AlignedAllocator<T, Align>>;
+#endif
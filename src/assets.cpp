@@ -0,0 +1,163 @@
+#include "assets.hpp"
+#include "objobject.hpp"
+#include "transform.hpp"
+#include "mappedfile.hpp"
+#include "hash.hpp"
+
+#include <iostream>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <climits>
+#include <cstdlib>
+
+using namespace std;
+
+// Registry state, each kind of asset has its own lock
+// NB: Locks are held while loading, so two threads asking for the same asset load it once. Images
+// are the exception, they decode unlocked so several can decode at once (a race costs a redundant decode)
+struct AssetMaps {
+    mutex imageLock;
+    map<string, weak_ptr<const Texture>> imagePaths;
+    map<uint64_t, weak_ptr<const Texture>> images;
+
+    mutex constantLock;
+    map<tuple<float, float, float>, weak_ptr<const Texture>> constants;
+
+    mutex materialLock;
+    map<tuple<const Texture *, const Texture *, const Texture *, bool, float>, weak_ptr<const Material>> materials;
+
+    mutex modelLock;
+    map<tuple<string, string, uint64_t>, weak_ptr<const ModelAsset>> modelPaths;
+    map<pair<uint64_t, string>, weak_ptr<const ModelAsset>> models;
+};
+
+static AssetMaps &assetMaps() {
+    static AssetMaps maps;
+    return maps;
+}
+
+// Absolute path without links (as given if that fails), so different spellings share an asset
+static string canonicalPath(const string &path) {
+    char buf[PATH_MAX];
+    return realpath(path.c_str(), buf) == nullptr ? path : string(buf);
+}
+
+// Set m[key] to asset, first erasing the entries of assets that are gone (so the maps only keep entries
+// of live assets, however many have been loaded over time)
+template <typename M, typename K, typename V>
+static void store(M &m, const K &key, const V &asset) {
+    for (auto it = m.begin(); it != m.end();) {
+        it = it->second.expired() ? m.erase(it) : next(it);
+    }
+    m[key] = asset;
+}
+
+// Live asset held by m under key (or nullptr)
+template <typename M, typename K>
+static auto lookup(M &m, const K &key) -> decltype(m.begin()->second.lock()) {
+    auto it = m.find(key);
+    return it == m.end() ? nullptr : it->second.lock();
+}
+
+TexturePtr Assets::image(const string &path) {
+    auto &maps = assetMaps();
+    auto name = canonicalPath(path);
+    {
+        lock_guard<mutex> lock(maps.imageLock);
+        auto tex = lookup(maps.imagePaths, name);
+        if (tex != nullptr) {
+            return tex;
+        }
+    }
+
+    auto file = MappedFile::open(name);
+    if (file == nullptr) {
+        cerr << "Error loading image: " << path << endl;
+        return nullptr;
+    }
+    auto key = hashBytes(file->data(), file->size());
+    {
+        lock_guard<mutex> lock(maps.imageLock);
+        auto tex = lookup(maps.images, key);
+        if (tex != nullptr) {
+            store(maps.imagePaths, name, tex);
+            return tex;
+        }
+    }
+
+    auto img = make_shared<Image>();
+    if (!img->loadPng(name)) {
+        return nullptr;
+    }
+
+    // Keep the first decode if another thread raced us to it
+    lock_guard<mutex> lock(maps.imageLock);
+    TexturePtr tex = lookup(maps.images, key);
+    if (tex == nullptr) {
+        tex = make_shared<TextureImage>(img);
+        store(maps.images, key, tex);
+    }
+    store(maps.imagePaths, name, tex);
+    return tex;
+}
+
+TexturePtr Assets::constant(const glm::vec3 &col) {
+    auto &maps = assetMaps();
+    lock_guard<mutex> lock(maps.constantLock);
+    auto key = make_tuple(col.r, col.g, col.b);
+    auto tex = lookup(maps.constants, key);
+    if (tex == nullptr) {
+        tex = make_shared<TextureConst>(col);
+        store(maps.constants, key, tex);
+    }
+    return tex;
+}
+
+MaterialPtr Assets::material(
+    const TexturePtr &kd, const TexturePtr &ks, const TexturePtr &km, bool mirror, float p)
+{
+    // NB: Textures are deduplicated too, so equal materials have the same texture pointers
+    auto &maps = assetMaps();
+    lock_guard<mutex> lock(maps.materialLock);
+    auto key = make_tuple(kd.get(), ks.get(), km.get(), mirror, p);
+    auto mat = lookup(maps.materials, key);
+    if (mat == nullptr) {
+        mat = make_shared<Material>(kd, ks, km, mirror, p);
+        store(maps.materials, key, mat);
+    }
+    return mat;
+}
+
+ModelAssetPtr Assets::model(const string &path, const string &base, const Transform &xform, uint threads) {
+    auto &maps = assetMaps();
+    lock_guard<mutex> lock(maps.modelLock);
+    auto name = canonicalPath(path), dir = canonicalPath(base);
+    auto matrix = xform.matrix();
+    auto pathKey = make_tuple(name, dir, fnv1aValue(matrix, FNV_OFFSET));
+    auto model = lookup(maps.modelPaths, pathKey);
+    if (model != nullptr) {
+        return model;
+    }
+
+    auto file = MappedFile::open(name);
+    if (file == nullptr) {
+        cerr << "Error loading model: " << path << endl;
+        return nullptr;
+    }
+    auto key = fnv1aValue(matrix, hashBytes(file->data(), file->size()));
+    file.reset();
+
+    model = lookup(maps.models, make_pair(key, dir));
+    if (model == nullptr) {
+        auto m = make_shared<ModelAsset>();
+        m->key = key;
+        if (!ObjObject::loadMeshes(name, base, xform, threads, m->meshes, m->mtls)) {
+            return nullptr;
+        }
+        model = m;
+        store(maps.models, make_pair(key, dir), model);
+    }
+    store(maps.modelPaths, pathKey, model);
+    return model;
+}
@@ -0,0 +1,49 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include "material.hpp"
+#include "texture.hpp"
+#include "mesh.hpp"
+#include "meshfile.hpp"
+
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+class Transform;
+
+// Shapes and mtl materials of a model file, as transformed when loaded
+// NB: Meshes have no materials of their own, see Mesh::share
+struct ModelAsset {
+    std::vector<MeshPtr> meshes;
+    std::vector<MeshFileMaterial> mtls;
+
+    // Hash of the file bytes and transform (eg. to key cached Bvhs)
+    uint64_t key;
+};
+
+typedef std::shared_ptr<const ModelAsset> ModelAssetPtr;
+
+// Process wide registry of loaded assets, which hands out shared (immutable) handles deduplicated by
+// path and by content, so eg. a png used by many materials or copies of a model are only loaded once
+// NB: Only weak references are kept, an asset nothing uses anymore is freed (and loaded again if
+// asked for later), and its entries are erased as others are added. Safe to call from several threads.
+class Assets {
+public:
+    // Png image texture, nullptr if it can't be loaded
+    static TexturePtr image(const std::string &path);
+
+    // Constant color texture
+    static TexturePtr constant(const glm::vec3 &col);
+
+    static MaterialPtr material(
+        const TexturePtr &kd, const TexturePtr &ks, const TexturePtr &km, bool mirror, float p);
+
+    // Model file (obj or mesh file, with mtl files in base) transformed by xform, see
+    // ObjObject::loadMeshes, nullptr if it can't be loaded
+    static ModelAssetPtr model(
+        const std::string &path, const std::string &base, const Transform &xform, uint threads);
+};
+#endif
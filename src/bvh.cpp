@@ -1,125 +1,1214 @@
 #include "bvh.hpp"
+#include "hash.hpp"
+#include "threadpool.hpp"
 
 #include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
 
 using namespace std;
 
-#define LEAF_SIZE 10
+typedef vector<BvhPrim>::iterator PrimIt;
+typedef aligned_vector<BvhLinearNode, 32> NodeArray;
 
-Bvh::Bvh(vector<shared_ptr<Triangle>> &mesh) :
-    root(mesh.size() > LEAF_SIZE ?
-        unique_ptr<BvhNode>(new BvhNode(mesh.begin(), mesh.end())) :
-        unique_ptr<BvhNode>(new BvhLeaf(mesh.begin(), mesh.end()))) {
+#ifdef BVH_STATS
+atomic<unsigned long long> BvhStats::rays(0);
+atomic<unsigned long long> BvhStats::nodeVisits(0);
+atomic<unsigned long long> BvhStats::triTests(0);
+
+void BvhStats::print() {
+    auto n = max(1ull, rays.load());
+    cout << "BVH stats: " << rays << " rays, "
+         << double(nodeVisits) / n << " node visits/ray, "
+         << double(triTests) / n << " triangle tests/ray" << endl;
+}
+#endif
+
+bool BvhConfig::setSplit(const string &name) {
+    if (name == "sah") {
+        split = SPLIT_SAH;
+    } else if (name == "mean") {
+        split = SPLIT_MEAN;
+    } else if (name == "lbvh") {
+        split = SPLIT_LBVH;
+    } else if (name == "hlbvh") {
+        split = SPLIT_HLBVH;
+    } else if (name == "sbvh") {
+        split = SPLIT_SBVH;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool BvhConfig::setMaxLeafSize(unsigned int n) {
+    if (n < 1 || n > BVH_MAX_LEAF_SIZE)
+        return false;
+    maxLeafSize = n;
+    return true;
+}
+
+bool BvhConfig::setWidth(unsigned int w) {
+    if (w != 2 && w != 4)
+        return false;
+    width = w;
+    return true;
+}
+
+bool BvhConfig::setMortonBits(unsigned int bits) {
+    if (bits != 30 && bits != 63)
+        return false;
+    mortonBits = bits;
+    return true;
+}
+
+uint64_t BvhConfig::hash() const {
+    uint64_t h = FNV_OFFSET;
+    h = fnv1aValue(uint32_t(split), h);
+    h = fnv1aValue(bins, h);
+    h = fnv1aValue(traversalCost, h);
+    h = fnv1aValue(leafCost, h);
+    h = fnv1aValue(maxLeafSize, h);
+    h = fnv1aValue(width, h);
+    h = fnv1aValue(mortonBits, h);
+    h = fnv1aValue(maxDuplication, h);
+    return h;
 }
 
-BvhNode::BvhNode(ForwardIt begin, ForwardIt end) {
-    // Partition based on the centroid bounding box (use largest dim)
-    AABB pb;
+static int widestAxis(const AABB &b) {
+    auto dx = b.x.second - b.x.first,
+         dy = b.y.second - b.y.first,
+         dz = b.z.second - b.z.first;
+    return (dx > dy && dx > dz) ? 0 : (dy > dz ? 1 : 2);
+}
+
+// Partition based on the centroid bounding box (use largest dim)
+static PrimIt splitMean(PrimIt begin, PrimIt end, const AABB &cb, const BvhConfig &cfg) {
     glm::vec3 centroid;
     uint count = 0;
-    for (auto t = begin; t != end; t = next(t), count++) {
-        // Dereference iterator, then deref pointer...
-        auto &tri = *t;
-        pb.update(tri->centroid);
-        box.update(tri->va.p);
-        box.update(tri->vb.p);
-        box.update(tri->vc.p);
-        centroid += tri->centroid;
+    for (auto p = begin; p != end; ++p, count++) {
+        centroid += p->centroid;
     }
 
+    // Children are leaf nodes if number of triangles <= maxLeafSize
+    if (count <= cfg.maxLeafSize)
+        return end;
+
     centroid /= count;
-    auto dx = pb.x.second - pb.x.first,
-         dy = pb.y.second - pb.y.first,
-         dz = pb.z.second - pb.z.first;
-
-    auto it = std::partition(begin, end, [centroid, dx, dy, dz](const shared_ptr<Triangle> &t){
-        if (dx > dy && dx > dz)
-            return t->centroid.x < centroid.x;
-        if (dy > dx && dy > dz)
-            return t->centroid.y < centroid.y;
-        else
-            return t->centroid.z < centroid.z;
+    auto axis = widestAxis(cb);
+    return std::partition(begin, end, [centroid, axis](const BvhPrim &p){
+        return p.centroid[axis] < centroid[axis];
+    });
+}
+
+// Number of leaf blocks needed for n prims
+static uint leafBlocks(uint n, const BvhConfig &cfg) {
+    uint block = max(1u, cfg.leafBlock);
+    return (n + block - 1) / block;
+}
+
+// Maps prims to bins by centroid along the axis with the widest centroid extent
+// NB: The centroid extent along that axis must be positive
+struct CentroidBins {
+    CentroidBins(const AABB &cb, const BvhConfig &cfg) :
+        axis(widestAxis(cb)), count(max(2u, cfg.bins))
+    {
+        glm::vec3 lo(cb.x.first, cb.y.first, cb.z.first),
+                  hi(cb.x.second, cb.y.second, cb.z.second);
+        start = lo[axis];
+        scale = count / (hi[axis] - lo[axis]);
+    }
+
+    uint operator()(const BvhPrim &p) const {
+        return min(count - 1, uint((p.centroid[axis] - start) * scale));
+    }
+
+    int axis;
+    uint count;
+    float start, scale;
+};
+
+// Cheapest split between bins, cost is blocks*area summed over both sides (not normalized)
+// NB: bin is 0 if every prim falls in the same bin
+struct ObjectSplit {
+    uint bin;
+    float cost;
+    AABB left, right;
+};
+
+static ObjectSplit bestObjectSplit(PrimIt begin, PrimIt end, const CentroidBins &binOf, const BvhConfig &cfg) {
+    uint nBins = binOf.count;
+    vector<AABB> bins(nBins);
+    vector<uint> counts(nBins, 0);
+    for (auto p = begin; p != end; ++p) {
+        auto b = binOf(*p);
+        counts[b]++;
+        bins[b].update(p->box);
+    }
+
+    // Sweep from the right to get the bounds/count right of each split plane
+    vector<AABB> right(nBins);
+    vector<uint> rightCount(nBins, 0);
+    AABB acc;
+    uint n = 0;
+    for (uint i = nBins - 1; i > 0; --i) {
+        acc.update(bins[i]);
+        n += counts[i];
+        right[i] = acc;
+        rightCount[i] = n;
+    }
+
+    // Sweep from the left and evaluate the cost of splitting before bin i
+    ObjectSplit best;
+    best.bin = 0;
+    best.cost = numeric_limits<float>::max();
+    acc = AABB();
+    n = 0;
+    for (uint i = 1; i < nBins; ++i) {
+        acc.update(bins[i - 1]);
+        n += counts[i - 1];
+        if (n == 0 || rightCount[i] == 0)
+            continue;
+
+        float cost = leafBlocks(n, cfg)*acc.area() + leafBlocks(rightCount[i], cfg)*right[i].area();
+        if (cost < best.cost) {
+            best.bin = i;
+            best.cost = cost;
+            best.left = acc;
+            best.right = right[i];
+        }
+    }
+    return best;
+}
+
+// Binned surface area heuristic (see Wald, "On fast Construction of SAH-based BVHs")
+// NB: Returns end if a leaf is cheaper than the best split
+static PrimIt splitSah(PrimIt begin, PrimIt end, const AABB &box, const AABB &cb, const BvhConfig &cfg) {
+    uint count = distance(begin, end);
+    if (count <= 1)
+        return end;
+
+    // Bin along the axis with the widest centroid extent
+    auto axis = widestAxis(cb);
+    glm::vec3 ext(cb.x.second - cb.x.first, cb.y.second - cb.y.first, cb.z.second - cb.z.first);
+    if (ext[axis] <= 0) {
+        // All centroids coincide so no split separates them, halve arbitrarily if too big
+        return count <= cfg.maxLeafSize ? end : next(begin, count/2);
+    }
+
+    CentroidBins binOf(cb, cfg);
+    auto best = bestObjectSplit(begin, end, binOf, cfg);
+    if (best.bin == 0)
+        return count <= cfg.maxLeafSize ? end : next(begin, count/2);
+
+    float cost = cfg.traversalCost + cfg.leafCost * best.cost / box.area();
+    if (count <= cfg.maxLeafSize && cost >= cfg.leafCost * leafBlocks(count, cfg))
+        return end;
+
+    return std::partition(begin, end, [&binOf, &best](const BvhPrim &p) {
+        return binOf(p) < best.bin;
+    });
+}
+
+// Object median split, used to bound the depth of the tree
+static PrimIt splitMedian(PrimIt begin, PrimIt end, const AABB &cb) {
+    auto axis = widestAxis(cb);
+    auto mid = next(begin, distance(begin, end)/2);
+    std::nth_element(begin, mid, end, [axis](const BvhPrim &a, const BvhPrim &b) {
+        return a.centroid[axis] < b.centroid[axis];
     });
+    return mid;
+}
+
+static pair<float, float> &slab(AABB &b, int axis) {
+    return axis == 0 ? b.x : (axis == 1 ? b.y : b.z);
+}
+
+static const pair<float, float> &slab(const AABB &b, int axis) {
+    return axis == 0 ? b.x : (axis == 1 ? b.y : b.z);
+}
 
-    // Children are leaf nodes if number of triangles < LEAF_SIZE
-    auto leftNodes = std::distance(begin, it),
-         rightNodes = std::distance(it, end);
+// Intersection of two boxes (empty if they are disjoint)
+static AABB boxOverlap(const AABB &a, const AABB &b) {
+    AABB o;
+    for (int axis = 0; axis < 3; ++axis) {
+        slab(o, axis).first = max(slab(a, axis).first, slab(b, axis).first);
+        slab(o, axis).second = min(slab(a, axis).second, slab(b, axis).second);
+    }
+    return o;
+}
+
+// Default BvhClipFn, only knows the ref's box
+static void cutBox(const BvhPrim &ref, int axis, float pos, AABB &left, AABB &right) {
+    left = right = ref.box;
+    slab(left, axis).second = min(slab(left, axis).second, pos);
+    slab(right, axis).first = max(slab(right, axis).first, pos);
+}
+
+struct BvhTree::SbvhBuild {
+    SbvhBuild(const BvhConfig &cfg, const BvhClipFn &clip, size_t prims) :
+        cfg(cfg), clip(clip), rootArea(0), budget(size_t(prims * max(0.0f, cfg.maxDuplication))) { }
+
+    const BvhConfig &cfg;
+    BvhClipFn clip;
+    float rootArea;
+    size_t budget;       // Duplicate references left
+    vector<BvhPrim> out; // Leaf refs in node order
+};
+
+void BvhTree::build(vector<BvhPrim> &prims, const BvhConfig &cfg, const BvhClipFn &clip) {
+    nodes.clear();
+    wide.clear();
+    if (prims.empty())
+        return;
 
-    if (leftNodes > LEAF_SIZE && rightNodes > 0) {
-        left = unique_ptr<BvhNode>(new BvhNode(begin, it));
+    // NB: Upper bound is 2n - 1 nodes (one prim per leaf)
+    NodeArray built;
+    built.reserve(2*prims.size() - 1);
+    if (cfg.split == BvhConfig::SPLIT_LBVH || cfg.split == BvhConfig::SPLIT_HLBVH) {
+        buildLbvh(built, prims, cfg);
+    } else if (cfg.split == BvhConfig::SPLIT_SBVH) {
+        SbvhBuild sb(cfg, clip ? clip : BvhClipFn(cutBox), prims.size());
+        buildSbvh(built, prims, sb, 0);
+        prims.swap(sb.out);
     } else {
-        left = unique_ptr<BvhNode>(new BvhLeaf(begin, it));
+        buildRange(built, prims, 0, prims.size(), cfg, 0, max(cfg.threads, 1u));
     }
 
-    if (rightNodes > LEAF_SIZE && leftNodes > 0) {
-        right = unique_ptr<BvhNode>(new BvhNode(it, end));
+    box = AABB();
+    box.update(built[0].lo);
+    box.update(built[0].hi);
+    if (cfg.width == 4) {
+        WideArray w;
+        collapse(built, w);
+        w.shrink_to_fit();
+        wide.assign(move(w));
+    } else {
+        built.shrink_to_fit();
+        nodes.assign(move(built));
+    }
+}
+
+void BvhTree::view(
+    const shared_ptr<const MappedFile> &file,
+    const BvhLinearNode *binary, size_t binaryCount,
+    const Bvh4Node *wideData, size_t wideCount,
+    const AABB &bounds)
+{
+    nodes.view(file, binary, binaryCount);
+    wide.view(file, wideData, wideCount);
+    box = bounds;
+}
+
+AABB BvhTree::bounds() const {
+    return box;
+}
+
+static float nodeArea(const BvhLinearNode &n) {
+    auto d = n.hi - n.lo;
+    return 2*(d.x*d.y + d.y*d.z + d.z*d.x);
+}
+
+void BvhTree::collapse(const NodeArray &nodes, WideArray &wide) {
+    // NB: A root leaf still gets a wide node (with one child) since traversal always starts at a node
+    if (nodes[0].count > 0) {
+        collapseNode(nodes, wide, {0});
     } else {
-        right = unique_ptr<BvhNode>(new BvhLeaf(it, end));
+        collapseNode(nodes, wide, {1, nodes[0].offset});
+    }
+}
+
+uint32_t BvhTree::collapseNode(const NodeArray &nodes, WideArray &wide, vector<uint32_t> kids) {
+    // Pull grandchildren up by opening the largest interior child until there are four
+    while (kids.size() < 4) {
+        int best = -1;
+        float bestArea = -1;
+        for (uint i = 0; i < kids.size(); ++i) {
+            const auto &n = nodes[kids[i]];
+            if (n.count == 0 && nodeArea(n) > bestArea) {
+                best = i;
+                bestArea = nodeArea(n);
+            }
+        }
+        if (best < 0)
+            break;
+
+        auto k = kids[best];
+        kids[best] = k + 1;
+        kids.emplace_back(nodes[k].offset);
+    }
+
+    uint32_t idx = wide.size();
+    wide.emplace_back();
+    for (uint k = 0; k < 4; ++k) {
+        // NB: wide may reallocate while collapsing children so always index (never hold a reference)
+        if (k >= kids.size()) {
+            for (uint a = 0; a < 3; ++a) {
+                wide[idx].lo[a][k] = wide[idx].hi[a][k] = numeric_limits<float>::infinity();
+            }
+            wide[idx].child[k] = BVH4_EMPTY;
+            wide[idx].count[k] = 0;
+            continue;
+        }
+
+        const auto &n = nodes[kids[k]];
+        for (uint a = 0; a < 3; ++a) {
+            wide[idx].lo[a][k] = n.lo[a];
+            wide[idx].hi[a][k] = n.hi[a];
+        }
+        if (n.count > 0) {
+            wide[idx].child[k] = n.offset;
+            wide[idx].count[k] = n.count;
+        } else {
+            auto child = collapseNode(nodes, wide, {kids[k] + 1, n.offset});
+            wide[idx].child[k] = child;
+            wide[idx].count[k] = 0;
+        }
     }
+    return idx;
 }
 
-BvhLeaf::BvhLeaf(ForwardIt begin, ForwardIt end) : mesh(begin, end) {
-    // Copies subrange of mesh in leaf node
-    // cout << "Leaf: " << mesh.size() << endl;
-    for (auto t = begin; t != end; t = next(t)) {
-        // Dereference iterator, then deref pointer...
-        auto &tri = *t;
-        box.update(tri->va.p);
-        box.update(tri->vb.p);
-        box.update(tri->vc.p);
+// Append a subtree built into its own array, interior offsets are relative to it so shift them
+static uint32_t splice(NodeArray &nodes, const NodeArray &sub) {
+    uint32_t base = nodes.size();
+    for (auto node : sub) {
+        if (node.count == 0) {
+            node.offset += base;
+        }
+        nodes.emplace_back(node);
     }
+    return base;
 }
 
-bool BvhNode::inBB(
-    const glm::vec3 &eye,
-    const glm::vec3 &dir,
-    const std::pair<float, float> &rng) const
+// Build both children of interior node idx by calling build(out, second, threads), if parallel (and
+// threads allow) they are built concurrently into separate arrays which are then spliced in order
+template <typename BuildFn>
+static void buildChildren(NodeArray &nodes, uint32_t idx, bool parallel, uint threads, BuildFn build) {
+    if (parallel && threads > 1) {
+        NodeArray left, right;
+        auto &pool = ThreadPool::global();
+        ThreadPool::Group group;
+        pool.submit(group, [&]() {
+            build(left, false, threads/2);
+        });
+        build(right, true, threads - threads/2);
+        pool.wait(group);
+
+        // NB: The first child must directly follow idx, and splice may reallocate nodes
+        // so it has to run before nodes[idx] is looked up
+        splice(nodes, left);
+        auto offset = splice(nodes, right);
+        nodes[idx].offset = offset;
+    } else {
+        build(nodes, false, 1);
+        nodes[idx].offset = nodes.size();
+        build(nodes, true, 1);
+    }
+    nodes[idx].count = 0;
+}
+
+uint32_t BvhTree::buildRange(
+    NodeArray &nodes,
+    vector<BvhPrim> &prims,
+    uint32_t begin,
+    uint32_t end,
+    const BvhConfig &cfg,
+    uint depth,
+    uint threads)
 {
-    // TODO: Check actual POI is positive
-    auto tx = calcT(eye.x, dir.x, box.x);
-    auto ty = calcT(eye.y, dir.y, box.y);
-    auto tz = calcT(eye.z, dir.z, box.z);
-    if (tx.first > ty.second || tx.first > tz.second) return false;
-    if (ty.first > tx.second || ty.first > tz.second) return false;
-    if (tz.first > ty.second || tz.first > tx.second) return false;
-
-    // Check if valid t is within range
-    if (max(max(tx.first, ty.first), tz.first) > rng.second) return false;
-    if (min(min(tx.second, ty.second), tz.second) < rng.first) return false;
-    return true;
+    uint32_t idx = nodes.size();
+    nodes.emplace_back();
+
+    AABB box, cb;
+    for (auto i = begin; i < end; ++i) {
+        box.update(prims[i].box);
+        cb.update(prims[i].centroid);
+    }
+
+    auto first = prims.begin() + begin, last = prims.begin() + end;
+    PrimIt mid;
+    if (depth >= BVH_MAX_DEPTH/2) {
+        // Switch to balanced splits so the traversal stack can never overflow
+        mid = end - begin <= cfg.maxLeafSize ? last : splitMedian(first, last, cb);
+    } else if (cfg.split == BvhConfig::SPLIT_SAH) {
+        mid = splitSah(first, last, box, cb, cfg);
+    } else {
+        mid = splitMean(first, last, cb, cfg);
+        if ((mid == first || mid == last) && end - begin > cfg.maxLeafSize) {
+            mid = splitMedian(first, last, cb);
+        }
+    }
+
+    // NB: nodes may reallocate while building children so always index (never hold a reference)
+    nodes[idx].lo = glm::vec3(box.x.first, box.y.first, box.z.first);
+    nodes[idx].hi = glm::vec3(box.x.second, box.y.second, box.z.second);
+    nodes[idx].axis = widestAxis(cb);
+    if (mid == first || mid == last) {
+        nodes[idx].offset = begin;
+        nodes[idx].count = end - begin;
+        return idx;
+    }
+
+    // Children partition disjoint prim ranges, so they can be built concurrently
+    uint32_t split = begin + distance(first, mid);
+    buildChildren(nodes, idx, end - begin >= BVH_PARALLEL_MIN, threads, [&](NodeArray &out, bool second, uint t) {
+        if (second) {
+            buildRange(out, prims, split, end, cfg, depth + 1, t);
+        } else {
+            buildRange(out, prims, begin, split, cfg, depth + 1, t);
+        }
+    });
+    return idx;
+}
+
+// Spread the low 10 (or 21) bits of v so there are two zero bits between each
+static uint64_t expandBits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// LSD radix sort on the low bits of code, a byte per pass
+// NB: Each chunk counts and scatters its own slice, so passes are stable and run in parallel
+static void radixSort(vector<MortonPrim> &v, uint bits, uint threads) {
+    const uint digits = 256;
+    uint chunks = v.size() >= BVH_PARALLEL_MIN ? max(threads, 1u) : 1;
+    size_t chunkSize = (v.size() + chunks - 1) / chunks;
+    vector<MortonPrim> tmp(v.size());
+    vector<size_t> offsets(chunks*digits);
+    for (uint shift = 0; shift < bits; shift += 8) {
+        fill(offsets.begin(), offsets.end(), 0);
+        ThreadPool::global().parallelFor(chunks, [&](uint c) {
+            auto end = min(v.size(), (c + 1)*chunkSize);
+            for (auto i = c*chunkSize; i < end; ++i) {
+                offsets[c*digits + ((v[i].code >> shift) & 0xff)]++;
+            }
+        });
+
+        // Digit d of chunk c starts after all smaller digits, and digit d of earlier chunks
+        size_t sum = 0;
+        for (uint d = 0; d < digits; ++d) {
+            for (uint c = 0; c < chunks; ++c) {
+                auto n = offsets[c*digits + d];
+                offsets[c*digits + d] = sum;
+                sum += n;
+            }
+        }
+
+        ThreadPool::global().parallelFor(chunks, [&](uint c) {
+            auto end = min(v.size(), (c + 1)*chunkSize);
+            for (auto i = c*chunkSize; i < end; ++i) {
+                tmp[offsets[c*digits + ((v[i].code >> shift) & 0xff)]++] = v[i];
+            }
+        });
+        v.swap(tmp);
+    }
+}
+
+void BvhTree::buildLbvh(NodeArray &nodes, vector<BvhPrim> &prims, const BvhConfig &cfg) {
+    uint threads = max(cfg.threads, 1u);
+    AABB cb;
+    for (const auto &p : prims) {
+        cb.update(p.centroid);
+    }
+
+    // Quantize centroids onto a 2^k grid per axis and interleave (x in the highest bit)
+    uint axisBits = cfg.mortonBits / 3;
+    uint bits = 3*axisBits;
+    float res = float(1u << axisBits);
+    glm::vec3 lo(cb.x.first, cb.y.first, cb.z.first),
+              ext(cb.x.second - cb.x.first, cb.y.second - cb.y.first, cb.z.second - cb.z.first);
+    auto scale = glm::vec3(
+        ext.x > 0 ? res / ext.x : 0,
+        ext.y > 0 ? res / ext.y : 0,
+        ext.z > 0 ? res / ext.z : 0);
+    vector<MortonPrim> codes(prims.size());
+    uint chunks = prims.size() >= BVH_PARALLEL_MIN ? threads : 1;
+    size_t chunkSize = (prims.size() + chunks - 1) / chunks;
+    ThreadPool::global().parallelFor(chunks, [&](uint c) {
+        auto end = min(prims.size(), (c + 1)*chunkSize);
+        for (auto i = c*chunkSize; i < end; ++i) {
+            auto q = glm::min((prims[i].centroid - lo) * scale, glm::vec3(res - 1));
+            codes[i].code = expandBits(uint64_t(q.x)) << 2 | expandBits(uint64_t(q.y)) << 1 | expandBits(uint64_t(q.z));
+            codes[i].idx = i;
+        }
+    });
+    radixSort(codes, bits, threads);
+
+    vector<BvhPrim> sorted(prims.size());
+    for (size_t i = 0; i < prims.size(); ++i) {
+        sorted[i] = prims[codes[i].idx];
+    }
+    prims.swap(sorted);
+
+    if (cfg.split == BvhConfig::SPLIT_LBVH) {
+        emitLbvh(nodes, prims, codes, 0, prims.size(), bits - 1, cfg, 0, threads);
+        return;
+    }
+
+    // Treelets are runs of prims sharing the leading Morton bits, so each spans a small region
+    uint topBits = min(uint(BVH_TREELET_BITS), bits);
+    uint shift = bits - topBits;
+    vector<BvhPrim> treelets;
+    vector<pair<uint32_t, uint32_t>> ranges;
+    for (uint32_t begin = 0, end; begin < prims.size(); begin = end) {
+        end = begin + 1;
+        while (end < prims.size() && (codes[end].code >> shift) == (codes[begin].code >> shift)) {
+            end++;
+        }
+
+        BvhPrim t;
+        for (auto i = begin; i < end; ++i) {
+            t.box.update(prims[i].box);
+        }
+        t.centroid = (glm::vec3(t.box.x.first, t.box.y.first, t.box.z.first) +
+                      glm::vec3(t.box.x.second, t.box.y.second, t.box.z.second)) * 0.5f;
+        t.idx = ranges.size();
+        treelets.emplace_back(t);
+        ranges.emplace_back(begin, end);
+    }
+
+    // SAH tree with one treelet per leaf (which also gives the depth each treelet starts at)
+    auto upperCfg = cfg;
+    upperCfg.split = BvhConfig::SPLIT_SAH;
+    upperCfg.maxLeafSize = 1;
+    upperCfg.leafBlock = 1;
+    NodeArray upper;
+    buildRange(upper, treelets, 0, treelets.size(), upperCfg, 0, 1);
+    vector<uint> depths(ranges.size());
+    vector<pair<uint32_t, uint>> stack = { make_pair(0u, 0u) };
+    while (!stack.empty()) {
+        auto n = stack.back();
+        stack.pop_back();
+        if (upper[n.first].count > 0) {
+            depths[treelets[upper[n.first].offset].idx] = n.second;
+        } else {
+            stack.emplace_back(n.first + 1, n.second + 1);
+            stack.emplace_back(upper[n.first].offset, n.second + 1);
+        }
+    }
+
+    // Emit treelets concurrently, then copy the upper tree replacing its leaves by them
+    vector<NodeArray> built(ranges.size());
+    atomic<size_t> next(0);
+    ThreadPool::global().parallelFor(min<size_t>(threads, ranges.size()), [&](uint) {
+        for (size_t i = next++; i < ranges.size(); i = next++) {
+            emitLbvh(built[i], prims, codes, ranges[i].first, ranges[i].second, shift - 1, cfg, depths[i], 1);
+        }
+    });
+    vector<uint32_t> remap(upper.size());
+    for (uint32_t i = 0; i < upper.size(); ++i) {
+        if (upper[i].count > 0) {
+            remap[i] = splice(nodes, built[treelets[upper[i].offset].idx]);
+        } else {
+            remap[i] = nodes.size();
+            nodes.emplace_back(upper[i]);
+        }
+    }
+    for (uint32_t i = 0; i < upper.size(); ++i) {
+        if (upper[i].count == 0) {
+            nodes[remap[i]].offset = remap[upper[i].offset];
+        }
+    }
+}
+
+// Prims [begin, end) are sorted by Morton code and agree on all bits above bit, split where bit changes
+uint32_t BvhTree::emitLbvh(
+    NodeArray &nodes,
+    vector<BvhPrim> &prims,
+    const vector<MortonPrim> &codes,
+    uint32_t begin,
+    uint32_t end,
+    int bit,
+    const BvhConfig &cfg,
+    uint depth,
+    uint threads)
+{
+    // Skip bits every prim agrees on (they do not split anything)
+    while (bit >= 0 && ((codes[begin].code ^ codes[end - 1].code) >> bit & 1) == 0) {
+        bit--;
+    }
+
+    // NB: Identical codes (or a deep tree) fall back to the regular builder, which also makes leaves
+    if (end - begin <= max(1u, cfg.leafBlock) || bit < 0 || depth >= BVH_MAX_DEPTH/2) {
+        return buildRange(nodes, prims, begin, end, cfg, depth, 1);
+    }
+
+    auto first = codes.begin() + begin, last = codes.begin() + end;
+    uint32_t split = begin + distance(first, partition_point(first, last, [bit](const MortonPrim &m) {
+        return (m.code >> bit & 1) == 0;
+    }));
+
+    uint32_t idx = nodes.size();
+    nodes.emplace_back();
+    buildChildren(nodes, idx, end - begin >= BVH_PARALLEL_MIN, threads, [&](NodeArray &out, bool second, uint t) {
+        if (second) {
+            emitLbvh(out, prims, codes, split, end, bit - 1, cfg, depth + 1, t);
+        } else {
+            emitLbvh(out, prims, codes, begin, split, bit - 1, cfg, depth + 1, t);
+        }
+    });
+
+    // Bounds come from the children (bit 3k + 2 splits x, 3k + 1 y, 3k z)
+    const auto &a = nodes[idx + 1], &b = nodes[nodes[idx].offset];
+    nodes[idx].lo = glm::min(a.lo, b.lo);
+    nodes[idx].hi = glm::max(a.hi, b.hi);
+    nodes[idx].axis = 2 - bit % 3;
+    return idx;
+}
+
+// Ref with its box replaced by (part of) it
+static BvhPrim clippedRef(const BvhPrim &ref, const AABB &box) {
+    BvhPrim p = ref;
+    p.box = box;
+    p.centroid = 0.5f*glm::vec3(
+        box.x.first + box.x.second,
+        box.y.first + box.y.second,
+        box.z.first + box.z.second);
+    return p;
+}
+
+// Split plane between spatial bins, with the bounds and number of refs either side of it
+struct SpatialSplit {
+    SpatialSplit() : cost(numeric_limits<float>::max()), axis(0), pos(0), leftCount(0), rightCount(0) { }
+
+    float cost;
+    int axis;
+    float pos;
+    AABB left, right;
+    uint leftCount, rightCount;
+};
+
+// Cheapest plane between bins along the widest axis of box, refs are clipped into every bin they overlap
+// NB: Cost is blocks*area summed over both sides as for bestObjectSplit, max float if box is flat
+static SpatialSplit bestSpatialSplit(const vector<BvhPrim> &refs, const AABB &box, const BvhConfig &cfg, const BvhClipFn &clip) {
+    SpatialSplit best;
+    best.axis = widestAxis(box);
+    auto range = slab(box, best.axis);
+    if (range.second <= range.first)
+        return best;
+
+    uint nBins = max(2u, cfg.bins);
+    float width = (range.second - range.first) / nBins;
+    auto binOf = [&](float v) {
+        return min(nBins - 1, uint(max(0.0f, v - range.first) / width));
+    };
+
+    // Count refs by the bins they enter and exit, clipping their bounds into each bin in between
+    vector<AABB> bins(nBins);
+    vector<uint> enter(nBins, 0), exit(nBins, 0);
+    for (const auto &ref : refs) {
+        uint b0 = binOf(slab(ref.box, best.axis).first), b1 = binOf(slab(ref.box, best.axis).second);
+        auto rest = ref;
+        for (uint b = b0; b < b1; ++b) {
+            AABB l, r;
+            clip(rest, best.axis, range.first + (b + 1)*width, l, r);
+            bins[b].update(l);
+            rest.box = r;
+        }
+        bins[b1].update(rest.box);
+        enter[b0]++;
+        exit[b1]++;
+    }
+
+    vector<AABB> right(nBins);
+    vector<uint> rightCount(nBins, 0);
+    AABB acc;
+    uint n = 0;
+    for (uint i = nBins - 1; i > 0; --i) {
+        acc.update(bins[i]);
+        n += exit[i];
+        right[i] = acc;
+        rightCount[i] = n;
+    }
+
+    acc = AABB();
+    n = 0;
+    for (uint i = 1; i < nBins; ++i) {
+        acc.update(bins[i - 1]);
+        n += enter[i - 1];
+        if (n == 0 || rightCount[i] == 0)
+            continue;
+
+        float cost = leafBlocks(n, cfg)*acc.area() + leafBlocks(rightCount[i], cfg)*right[i].area();
+        if (cost < best.cost) {
+            best.cost = cost;
+            best.pos = range.first + i*width;
+            best.left = acc;
+            best.right = right[i];
+            best.leftCount = n;
+            best.rightCount = rightCount[i];
+        }
+    }
+    return best;
+}
+
+// Distribute refs either side of a spatial split, duplicating the ones it cuts while budget lasts
+static void splitSpatial(
+    const vector<BvhPrim> &refs,
+    SpatialSplit sp,
+    const BvhClipFn &clip,
+    size_t &budget,
+    vector<BvhPrim> &left,
+    vector<BvhPrim> &right)
+{
+    for (const auto &ref : refs) {
+        const auto &r = slab(ref.box, sp.axis);
+        if (r.second <= sp.pos) {
+            left.emplace_back(ref);
+            continue;
+        }
+        if (r.first >= sp.pos) {
+            right.emplace_back(ref);
+            continue;
+        }
+
+        // Reference unsplitting: keep the ref whole on one side if that is no more expensive
+        AABB wholeLeft = sp.left, wholeRight = sp.right;
+        wholeLeft.update(ref.box);
+        wholeRight.update(ref.box);
+        float splitCost = sp.left.area()*sp.leftCount + sp.right.area()*sp.rightCount;
+        float leftCost = wholeLeft.area()*sp.leftCount + sp.right.area()*(sp.rightCount - 1);
+        float rightCost = sp.left.area()*(sp.leftCount - 1) + wholeRight.area()*sp.rightCount;
+        AABB l, rt;
+        clip(ref, sp.axis, sp.pos, l, rt);
+        if (budget == 0 || l.empty() || rt.empty() || min(leftCost, rightCost) <= splitCost) {
+            if (rt.empty() || (!l.empty() && leftCost <= rightCost)) {
+                left.emplace_back(ref);
+                sp.left = wholeLeft;
+                sp.rightCount--;
+            } else {
+                right.emplace_back(ref);
+                sp.right = wholeRight;
+                sp.leftCount--;
+            }
+            continue;
+        }
+
+        left.emplace_back(clippedRef(ref, l));
+        right.emplace_back(clippedRef(ref, rt));
+        budget--;
+    }
+}
+
+uint32_t BvhTree::buildSbvh(NodeArray &nodes, vector<BvhPrim> &refs, SbvhBuild &sb, uint depth) {
+    const auto &cfg = sb.cfg;
+    uint32_t idx = nodes.size();
+    nodes.emplace_back();
+
+    AABB box, cb;
+    for (const auto &ref : refs) {
+        box.update(ref.box);
+        cb.update(ref.centroid);
+    }
+    if (depth == 0) {
+        sb.rootArea = box.area();
+    }
+
+    nodes[idx].lo = glm::vec3(box.x.first, box.y.first, box.z.first);
+    nodes[idx].hi = glm::vec3(box.x.second, box.y.second, box.z.second);
+    nodes[idx].axis = widestAxis(cb);
+
+    uint count = refs.size();
+    vector<BvhPrim> left, right;
+    if (depth >= BVH_MAX_DEPTH/2) {
+        // Switch to balanced object splits so the traversal stack can never overflow
+        if (count > cfg.maxLeafSize) {
+            auto mid = splitMedian(refs.begin(), refs.end(), cb);
+            left.assign(refs.begin(), mid);
+            right.assign(mid, refs.end());
+        }
+    } else if (count > 1) {
+        CentroidBins binOf(cb, cfg);
+        ObjectSplit obj;
+        obj.bin = 0;
+        obj.cost = numeric_limits<float>::max();
+        if (slab(cb, binOf.axis).second > slab(cb, binOf.axis).first) {
+            obj = bestObjectSplit(refs.begin(), refs.end(), binOf, cfg);
+        }
+
+        // Spatial splits only pay off where the object split children overlap noticeably
+        SpatialSplit sp;
+        if (sb.budget > 0 && (obj.bin == 0 || boxOverlap(obj.left, obj.right).area() > SBVH_ALPHA*sb.rootArea)) {
+            sp = bestSpatialSplit(refs, box, cfg, sb.clip);
+        }
+
+        float best = min(obj.cost, sp.cost);
+        bool leaf = count <= cfg.maxLeafSize && (best == numeric_limits<float>::max() ||
+            cfg.traversalCost + cfg.leafCost*best/box.area() >= cfg.leafCost*leafBlocks(count, cfg));
+        if (!leaf) {
+            if (sp.cost < obj.cost) {
+                // NB: The spatial split axis comes from box rather than cb, so it may differ from the
+                // node's axis so far (which traversal uses to order the children)
+                splitSpatial(refs, sp, sb.clip, sb.budget, left, right);
+                if (!left.empty() && !right.empty()) {
+                    nodes[idx].axis = sp.axis;
+                }
+            }
+
+            // NB: Unsplitting may have moved every ref to one side, use the object split instead then
+            if (left.empty() || right.empty()) {
+                left.clear();
+                right.clear();
+                for (uint i = 0; i < count; ++i) {
+                    bool first = obj.bin > 0 ? binOf(refs[i]) < obj.bin : i < count/2;
+                    (first ? left : right).emplace_back(refs[i]);
+                }
+            }
+        }
+    }
+
+    if (left.empty() || right.empty()) {
+        nodes[idx].offset = sb.out.size();
+        nodes[idx].count = count;
+        sb.out.insert(sb.out.end(), refs.begin(), refs.end());
+        return idx;
+    }
+
+    // Children own their refs from here on
+    vector<BvhPrim>().swap(refs);
+    buildSbvh(nodes, left, sb, depth + 1);
+    auto second = buildSbvh(nodes, right, sb, depth + 1);
+    nodes[idx].offset = second;
+    nodes[idx].count = 0;
+    return idx;
 }
 
-bool BvhNode::intersect(
+Bvh::Bvh(const shared_ptr<const Mesh> &mesh, const BvhConfig &cfg) : mesh(mesh) {
+    vector<BvhPrim> prims(mesh->numTriangles());
+    for (uint32_t i = 0; i < prims.size(); ++i) {
+        prims[i].box = mesh->triBounds(i);
+        prims[i].centroid = mesh->centroid(i);
+        prims[i].idx = i;
+    }
+
+    // Spatial splits clip the triangle itself (tighter than cutting its box)
+    auto clip = [&mesh](const BvhPrim &ref, int axis, float pos, AABB &left, AABB &right) {
+        for (uint k = 0; k < 3; ++k) {
+            const auto &a = mesh->pos(ref.idx, k), &b = mesh->pos(ref.idx, (k + 1) % 3);
+            if (a[axis] <= pos) {
+                left.update(a);
+            }
+            if (a[axis] >= pos) {
+                right.update(a);
+            }
+
+            // Edges crossing the plane add the crossing point to both sides
+            if ((a[axis] < pos && b[axis] > pos) || (a[axis] > pos && b[axis] < pos)) {
+                auto p = glm::mix(a, b, (pos - a[axis]) / (b[axis] - a[axis]));
+                p[axis] = pos;
+                left.update(p);
+                right.update(p);
+            }
+        }
+        left = boxOverlap(left, ref.box);
+        right = boxOverlap(right, ref.box);
+    };
+
+    // Leaves are tested a pack at a time, so let SAH fill them
+    // NB: With spatial splits a triangle may be in several leaves, closest hit is still correct since
+    // every leaf reports the true t of the triangle
+    auto packCfg = cfg;
+    packCfg.leafBlock = TRIPACK_WIDTH;
+    tree.build(prims, packCfg, clip);
+
+    // Pack each leaf's triangles so a leaf is a contiguous range of packs
+    aligned_vector<TriPack, 16> built;
+    tree.remapLeaves([&](uint32_t offset, uint16_t count) {
+        uint32_t first = built.size();
+        for (uint32_t i = 0; i < count; ++i) {
+            if (i % TRIPACK_WIDTH == 0) {
+                built.emplace_back();
+            }
+            built.back().set(i % TRIPACK_WIDTH, *mesh, prims[offset + i].idx);
+        }
+        return make_pair(first, uint16_t(built.size() - first));
+    });
+    packs.assign(move(built));
+}
+
+bool Bvh::intersect(
     const glm::vec3 &eye,
     const glm::vec3 &dir,
     HitRecord &minHr,
-    const std::pair<float, float> &rng) const {
-    if (!inBB(eye, dir, rng))
+    const std::pair<float, float> &rng) const
+{
+    const auto &kernel = triPackKernel();
+    auto r = make_pair(rng.first, min(rng.second, minHr.t));
+    tree.traverse(eye, dir, r, [&](uint32_t first, uint32_t count) {
+        BVH_STAT_N(triTests, count*TRIPACK_WIDTH);
+        uint32_t tri;
+        glm::vec2 bary;
+        if (kernel.intersect(&packs[first], count, eye, dir, r.first, r.second, tri, bary)) {
+            // NB: r.second was tightened to min(rng.second, minHr.t), so this hit is the closest yet
+            minHr.t = r.second;
+            minHr.surf = mesh.get();
+            minHr.inst = nullptr;
+            minHr.prim = tri;
+            minHr.bary = bary;
+        }
         return false;
+    });
 
-    // NB: Each leaf node will check whether hr.t < minHr.t passed down
-    // so we can safely delegate to the leaf nodes
-    // TODO: Should minHr.t and rng.second are redundant
-    left->intersect(eye, dir, minHr, make_pair(rng.first, min(rng.second, minHr.t)));
-    right->intersect(eye, dir, minHr, make_pair(rng.first, min(rng.second, minHr.t)));
     return minHr.surf != nullptr;
 }
 
-bool BvhLeaf::intersect(
+bool Bvh::occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const {
+    const auto &kernel = triPackKernel();
+    auto r = make_pair(0.0f, tmax);
+    bool hit = false;
+    tree.traverse(eye, dir, r, [&](uint32_t first, uint32_t count) {
+        BVH_STAT_N(triTests, count*TRIPACK_WIDTH);
+        hit = kernel.occluded(&packs[first], count, eye, dir, tmax);
+        return hit;
+    });
+    return hit;
+}
+
+// Cache file header, followed by the node, wide node and pack arrays (each 64 byte aligned)
+// NB: Arrays are stored exactly as in memory, so files are only valid for the same build of raytrace
+#define BVH_CACHE_MAGIC "RTBVH\0\0"
+#define BVH_CACHE_VERSION 1
+#define BVH_CACHE_ALIGN 64
+
+struct BvhCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t packWidth;
+    uint64_t key;
+    uint32_t nodeSize, wideSize, packSize, triangles;
+    float lo[3], hi[3];
+    uint64_t nodeOffset, nodeCount;
+    uint64_t wideOffset, wideCount;
+    uint64_t packOffset, packCount;
+};
+
+static uint64_t cacheAlign(uint64_t offset) {
+    return (offset + BVH_CACHE_ALIGN - 1) / BVH_CACHE_ALIGN * BVH_CACHE_ALIGN;
+}
+
+// Check the mapped arrays of a cache file can be traversed without leaving them, so a corrupt file
+// (whose header still matches) is rebuilt rather than read out of bounds
+// NB: Children must come after their parent (as the builder lays them out) which rules out cycles,
+// and no path may be deeper than the traversal stacks
+static bool validCacheArrays(
+    const BvhLinearNode *nodes, uint64_t nodeCount,
+    const Bvh4Node *wide, uint64_t wideCount,
+    const TriPack *packs, uint64_t packCount,
+    uint32_t triangles)
+{
+    auto validLeaf = [packCount](uint64_t first, uint64_t count) {
+        return first <= packCount && count <= packCount - first;
+    };
+    auto validChild = [](vector<uint8_t> &depth, uint64_t parent, uint64_t child, uint64_t count) {
+        if (child <= parent || child >= count || depth[parent] + 1 >= BVH_MAX_DEPTH)
+            return false;
+        depth[child] = max<uint8_t>(depth[child], depth[parent] + 1);
+        return true;
+    };
+
+    // Traversal uses the wide nodes if there are any, the binary ones otherwise
+    if (wideCount > 0) {
+        vector<uint8_t> depth(wideCount, 0);
+        for (uint64_t i = 0; i < wideCount; ++i) {
+            for (uint k = 0; k < 4; ++k) {
+                const auto &n = wide[i];
+                if (n.count[k] > 0 ? !validLeaf(n.child[k], n.count[k]) :
+                    n.child[k] != BVH4_EMPTY && !validChild(depth, i, n.child[k], wideCount))
+                    return false;
+            }
+        }
+    } else {
+        vector<uint8_t> depth(nodeCount, 0);
+        for (uint64_t i = 0; i < nodeCount; ++i) {
+            const auto &n = nodes[i];
+            if (n.axis > 2)
+                return false;
+            if (n.count > 0 ? !validLeaf(n.offset, n.count) :
+                !validChild(depth, i, i + 1, nodeCount) || n.offset <= i + 1 || !validChild(depth, i, n.offset, nodeCount))
+                return false;
+        }
+    }
+
+    // Hits report a pack lane's triangle, unused lanes have zero edges so they are never hit
+    for (uint64_t i = 0; i < packCount; ++i) {
+        for (uint k = 0; k < TRIPACK_WIDTH; ++k) {
+            const auto &p = packs[i];
+            if (p.tri[k] < triangles)
+                continue;
+            if (p.tri[k] != TRIPACK_EMPTY)
+                return false;
+            for (uint a = 0; a < 3; ++a) {
+                if (p.e1[a][k] != 0 || p.e2[a][k] != 0)
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool Bvh::save(const string &path, uint64_t key) const {
+    const auto &nodes = tree.binaryNodes();
+    const auto &wide = tree.wideNodes();
+    auto box = tree.bounds();
+
+    BvhCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BVH_CACHE_MAGIC, sizeof(h.magic));
+    h.version = BVH_CACHE_VERSION;
+    h.packWidth = TRIPACK_WIDTH;
+    h.key = key;
+    h.nodeSize = sizeof(BvhLinearNode);
+    h.wideSize = sizeof(Bvh4Node);
+    h.packSize = sizeof(TriPack);
+    h.triangles = mesh->numTriangles();
+    h.lo[0] = box.x.first; h.lo[1] = box.y.first; h.lo[2] = box.z.first;
+    h.hi[0] = box.x.second; h.hi[1] = box.y.second; h.hi[2] = box.z.second;
+    h.nodeOffset = cacheAlign(sizeof(h));
+    h.nodeCount = nodes.size();
+    h.wideOffset = cacheAlign(h.nodeOffset + h.nodeCount*sizeof(BvhLinearNode));
+    h.wideCount = wide.size();
+    h.packOffset = cacheAlign(h.wideOffset + h.wideCount*sizeof(Bvh4Node));
+    h.packCount = packs.size();
+
+    // NB: Written under a unique temporary name and renamed, so a concurrent run never maps a partial file
+    auto tmp = MappedFile::tempPath(path);
+    ofstream out(tmp, ios::binary);
+    auto put = [&out](uint64_t offset, const void *data, size_t n) {
+        static const char zeros[BVH_CACHE_ALIGN] = {};
+        out.write(zeros, offset - out.tellp());
+        out.write(static_cast<const char *>(data), n);
+    };
+    out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    put(h.nodeOffset, nodes.data(), h.nodeCount*sizeof(BvhLinearNode));
+    put(h.wideOffset, wide.data(), h.wideCount*sizeof(Bvh4Node));
+    put(h.packOffset, packs.data(), h.packCount*sizeof(TriPack));
+    out.close();
+    if (!out || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+shared_ptr<Bvh> Bvh::load(const string &path, uint64_t key, const shared_ptr<const Mesh> &mesh) {
+    auto file = MappedFile::open(path);
+    if (file == nullptr || file->size() < sizeof(BvhCacheHeader))
+        return nullptr;
+
+    BvhCacheHeader h;
+    memcpy(&h, file->data(), sizeof(h));
+    if (memcmp(h.magic, BVH_CACHE_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != BVH_CACHE_VERSION ||
+        h.packWidth != TRIPACK_WIDTH ||
+        h.key != key ||
+        h.nodeSize != sizeof(BvhLinearNode) ||
+        h.wideSize != sizeof(Bvh4Node) ||
+        h.packSize != sizeof(TriPack) ||
+        h.triangles != mesh->numTriangles())
+        return nullptr;
+
+    // Arrays must lie inside the file (and be aligned, mappings start on a page)
+    auto fits = [&file](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset % BVH_CACHE_ALIGN == 0 && offset <= file->size() && count <= (file->size() - offset) / size;
+    };
+    if (!fits(h.nodeOffset, h.nodeCount, sizeof(BvhLinearNode)) ||
+        !fits(h.wideOffset, h.wideCount, sizeof(Bvh4Node)) ||
+        !fits(h.packOffset, h.packCount, sizeof(TriPack)))
+        return nullptr;
+
+    auto base = file->data();
+    auto nodes = reinterpret_cast<const BvhLinearNode *>(base + h.nodeOffset);
+    auto wide = reinterpret_cast<const Bvh4Node *>(base + h.wideOffset);
+    auto packs = reinterpret_cast<const TriPack *>(base + h.packOffset);
+    if (!validCacheArrays(nodes, h.nodeCount, wide, h.wideCount, packs, h.packCount, h.triangles))
+        return nullptr;
+
+    AABB box;
+    box.update(glm::vec3(h.lo[0], h.lo[1], h.lo[2]));
+    box.update(glm::vec3(h.hi[0], h.hi[1], h.hi[2]));
+    shared_ptr<Bvh> bvh(new Bvh());
+    bvh->mesh = mesh;
+    bvh->tree.view(file, nodes, h.nodeCount, wide, h.wideCount, box);
+    bvh->packs.view(file, packs, h.packCount);
+    return bvh;
+}
+
+SceneBvh::SceneBvh(const vector<shared_ptr<Object>> &scene, const BvhConfig &cfg) {
+    vector<BvhPrim> prims;
+    vector<shared_ptr<Object>> bounded;
+    for (const auto &obj : scene) {
+        BvhPrim p;
+        if (!obj->getBounds(p.box)) {
+            unbounded.emplace_back(obj);
+            continue;
+        }
+
+        p.centroid = 0.5f*glm::vec3(
+            p.box.x.first + p.box.x.second,
+            p.box.y.first + p.box.y.second,
+            p.box.z.first + p.box.z.second);
+        p.idx = bounded.size();
+        prims.emplace_back(p);
+        bounded.emplace_back(obj);
+    }
+
+    tree.build(prims, cfg);
+    objs.reserve(prims.size());
+    for (const auto &p : prims) {
+        objs.emplace_back(bounded[p.idx]);
+    }
+}
+
+bool SceneBvh::intersect(
     const glm::vec3 &eye,
     const glm::vec3 &dir,
     HitRecord &minHr,
     const std::pair<float, float> &rng) const
 {
-    if (mesh.size() == 0)
-        return false;
+    // NB: Objects only update minHr for closer hits, so it can be shared by all of them
+    auto r = make_pair(rng.first, min(rng.second, minHr.t));
+    for (const auto &obj : unbounded) {
+        obj->intersect(eye, dir, minHr, r);
+        r.second = min(r.second, minHr.t);
+    }
 
-    if (!BvhNode::inBB(eye, dir, rng))
+    tree.traverse(eye, dir, r, [&](uint32_t first, uint32_t count) {
+        for (auto i = first; i < first + count; ++i) {
+            objs[i]->intersect(eye, dir, minHr, r);
+            r.second = min(r.second, minHr.t);
+        }
         return false;
+    });
 
-    for (const auto &triangle : mesh) {
-        triangle->intersect(eye, dir, minHr, rng);
+    return minHr.surf != nullptr;
+}
+
+bool SceneBvh::occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const {
+    for (const auto &obj : unbounded) {
+        if (obj->occluded(eye, dir, tmax))
+            return true;
     }
 
-    return minHr.surf != nullptr;
+    bool hit = false;
+    auto r = make_pair(0.0f, tmax);
+    tree.traverse(eye, dir, r, [&](uint32_t first, uint32_t count) {
+        for (auto i = first; i < first + count && !hit; ++i) {
+            hit = objs[i]->occluded(eye, dir, tmax);
+        }
+        return hit;
+    });
+    return hit;
+}
+
+bool SceneBvh::getBounds(AABB &box) const {
+    box.update(tree.bounds());
+    return unbounded.empty();
 }
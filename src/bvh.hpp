@@ -2,60 +2,441 @@
 #define BVH_H
 
 #include "surface.hpp"
-#include "triangle.hpp"
+#include "mesh.hpp"
 #include "aabb.hpp"
+#include "aligned.hpp"
+#include "tripack.hpp"
+#include "mappedfile.hpp"
 
 #include <vector>
 #include <memory>
+#include <string>
+#include <cstdint>
+#include <functional>
 
-typedef std::vector<std::shared_ptr<Triangle>>::iterator ForwardIt;
+#ifdef __SSE2__
+#include <xmmintrin.h>
+#endif
+
+#ifdef BVH_STATS
+#include <atomic>
+
+// Traversal counters (build with -DBVH_STATS), summed over all threads
+struct BvhStats {
+    static std::atomic<unsigned long long> rays;
+    static std::atomic<unsigned long long> nodeVisits;
+    static std::atomic<unsigned long long> triTests;
+    static void print();
+};
+#define BVH_STAT_N(counter, n) BvhStats::counter.fetch_add(n, std::memory_order_relaxed)
+#else
+#define BVH_STAT_N(counter, n)
+#endif
+#define BVH_STAT(counter) BVH_STAT_N(counter, 1)
+
+// Traversal stack size, the builder never produces deeper trees
+#define BVH_MAX_DEPTH 64
+
+// Smallest prim range worth building on its own thread
+#define BVH_PARALLEL_MIN 4096
+
+// Largest leaf the node formats can describe (BvhLinearNode::count and Bvh4Node::count are 16 bit)
+#define BVH_MAX_LEAF_SIZE 0xffffu
+
+// Leading Morton code bits grouping prims into the treelets of SPLIT_HLBVH
+#define BVH_TREELET_BITS 12
+
+// SPLIT_SBVH only tries spatial splits where object split children overlap by more than this
+// fraction of the root's area (see Stich et al., "Spatial Splits in Bounding Volume Hierarchies")
+#define SBVH_ALPHA 1e-5f
+
+// Build parameters (set from "bvh" in scene config, overridable on command line)
+struct BvhConfig {
+    enum Split {
+        SPLIT_MEAN, // Split at mean centroid along widest axis
+        SPLIT_SAH,  // Binned surface area heuristic
+        SPLIT_LBVH, // Sort by Morton code and split where the codes differ (fast build, lower quality)
+        SPLIT_HLBVH,// LBVH treelets joined by a SAH tree over their bounds
+        SPLIT_SBVH  // SAH choosing between object splits and spatial splits (which duplicate prims)
+    };
+
+    // NB: A triangle test costs far less than visiting a node (and the memory fetch it implies), higher
+    // leaf costs give tiny leaves and deeper trees which visit more nodes per ray than the mean split
+    BvhConfig() :
+        split(SPLIT_SAH), bins(16), traversalCost(1.0f), leafCost(0.2f), maxLeafSize(10), leafBlock(1),
+        width(4), threads(1), mortonBits(30), maxDuplication(0.5f), lazy(true) { }
+
+    // Hash of the settings that affect the built tree (not threads, cacheDir or lazy)
+    uint64_t hash() const;
+
+    // Returns false if name is not a known split method
+    bool setSplit(const std::string &name);
+
+    // Returns false unless n is in [1, BVH_MAX_LEAF_SIZE]
+    bool setMaxLeafSize(unsigned int n);
+
+    // Returns false unless w is a supported node width (2 or 4)
+    bool setWidth(unsigned int w);
+
+    // Returns false unless bits is a supported Morton code length (30 or 63)
+    bool setMortonBits(unsigned int bits);
+
+    Split split;
+    unsigned int bins;
+    float traversalCost;      // Cost of visiting an interior node
+    float leafCost;           // Cost of a single triangle test
+    unsigned int maxLeafSize; // Leaf size for mean split, SAH always splits larger leaves (see setMaxLeafSize)
+    unsigned int leafBlock;   // Prims tested together in a leaf (eg. TRIPACK_WIDTH), SAH costs whole blocks
+    unsigned int width;       // Children per node when traversing (2, or 4 to collapse into a Bvh4Node tree)
+    unsigned int threads;     // Threads used to build subtrees (and independent objects) concurrently
+    unsigned int mortonBits;  // Morton code length for SPLIT_LBVH/SPLIT_HLBVH, 63 resolves larger meshes
+    float maxDuplication;     // Extra references SPLIT_SBVH may create, as a fraction of the prim count
+    std::string cacheDir;     // Mesh Bvhs are saved to (and mapped back from) here if set, see Bvh::load
+    bool lazy;                // Mesh Bvhs are built when a ray first reaches the mesh rather than at load (see ObjObject)
+};
 
-class BvhNode : public Object {
+// Primitive reference used during construction
+struct BvhPrim {
+    AABB box;
+    glm::vec3 centroid;
+    uint32_t idx;
+};
+
+// Bounds of the parts of ref either side of the plane at pos along axis (for spatial splits)
+// NB: The default just cuts ref.box, clipping the actual prim gives tighter boxes
+typedef std::function<void(const BvhPrim &ref, int axis, float pos, AABB &left, AABB &right)> BvhClipFn;
+
+// Prim index keyed by the Morton code of its centroid (see SPLIT_LBVH)
+struct MortonPrim {
+    uint64_t code;
+    uint32_t idx;
+};
+
+// Flattened node (two per cache line)
+// NB: Interior nodes store their first child immediately after them, and offset is the second child.
+// Leaves (count > 0) reference prims [offset, offset + count) in build order.
+struct alignas(32) BvhLinearNode {
+    glm::vec3 lo;
+    uint32_t offset;
+    glm::vec3 hi;
+    uint16_t count;
+    uint8_t axis;
+    uint8_t pad;
+};
+static_assert(sizeof(BvhLinearNode) == 32, "BvhLinearNode should be 32 bytes");
+
+#define BVH4_EMPTY 0xffffffffu
+
+// Four wide node (two cache lines), child boxes are stored SoA so one SIMD slab test covers all of them
+// NB: child is a node index if count is 0, otherwise a leaf [child, child + count). Unused slots
+// have child BVH4_EMPTY and a box at infinity which no ray can enter.
+struct alignas(64) Bvh4Node {
+    float lo[3][4];
+    float hi[3][4];
+    uint32_t child[4];
+    uint16_t count[4];
+};
+static_assert(sizeof(Bvh4Node) == 128, "Bvh4Node should be 128 bytes");
+
+// Hierarchy over primitive bounds stored in one contiguous array
+class BvhTree {
 public:
-    BvhNode(ForwardIt begin, ForwardIt end);
-    BvhNode() { }
-    bool intersect(
+    // Reorders prims so that leaves index contiguous ranges of it
+    // NB: SPLIT_SBVH may reference a prim from several leaves, so prims can also grow (see clip)
+    void build(std::vector<BvhPrim> &prims, const BvhConfig &cfg, const BvhClipFn &clip = BvhClipFn());
+
+    // Calls leaf(first, count) for each leaf the ray enters within rng, stopping early if it returns true
+    // NB: leaf may shrink rng.second (closest hit so far) to cull the remaining nodes
+    template <typename LeafFn>
+    void traverse(
         const glm::vec3 &eye,
         const glm::vec3 &dir,
-        HitRecord &hr,
-        const std::pair<float, float> &rng) const;
-protected:
-    AABB box;
-    bool inBB(
+        std::pair<float, float> &rng,
+        LeafFn leaf) const;
+
+    bool empty() const { return nodes.empty() && wide.empty(); }
+    AABB bounds() const;
+
+    // Arrays as saved in a cache file (wide is only set for 4 wide trees, nodes otherwise)
+    const MappedArray<BvhLinearNode, 32> &binaryNodes() const { return nodes; }
+    const MappedArray<Bvh4Node, 64> &wideNodes() const { return wide; }
+
+    // Use node arrays inside a mapped cache file instead of building
+    void view(
+        const std::shared_ptr<const MappedFile> &file,
+        const BvhLinearNode *binary, size_t binaryCount,
+        const Bvh4Node *wideData, size_t wideCount,
+        const AABB &bounds);
+
+    // Replace each leaf's prim range by f(offset, count) (eg. to point at packed data instead)
+    // NB: Only for built trees (not views)
+    template <typename RemapFn>
+    void remapLeaves(RemapFn f);
+private:
+    typedef aligned_vector<BvhLinearNode, 32> NodeArray;
+    typedef aligned_vector<Bvh4Node, 64> WideArray;
+    static uint32_t buildRange(
+        NodeArray &nodes,
+        std::vector<BvhPrim> &prims,
+        uint32_t begin,
+        uint32_t end,
+        const BvhConfig &cfg,
+        uint depth,
+        uint threads);
+
+    // Linear BVH builders (prims are reordered by Morton code)
+    static void buildLbvh(NodeArray &nodes, std::vector<BvhPrim> &prims, const BvhConfig &cfg);
+    static uint32_t emitLbvh(
+        NodeArray &nodes,
+        std::vector<BvhPrim> &prims,
+        const std::vector<MortonPrim> &codes,
+        uint32_t begin,
+        uint32_t end,
+        int bit,
+        const BvhConfig &cfg,
+        uint depth,
+        uint threads);
+
+    // Spatial split builder, refs are consumed and leaves appended to the build's output prims
+    struct SbvhBuild;
+    static uint32_t buildSbvh(NodeArray &nodes, std::vector<BvhPrim> &refs, SbvhBuild &sb, uint depth);
+
+    // Convert a binary tree into Bvh4Nodes (traverse then uses those instead)
+    static void collapse(const NodeArray &nodes, WideArray &wide);
+    static uint32_t collapseNode(const NodeArray &nodes, WideArray &wide, std::vector<uint32_t> kids);
+
+    template <typename LeafFn>
+    void traverseWide(
         const glm::vec3 &eye,
         const glm::vec3 &dir,
-        const std::pair<float, float> &rng) const;
+        std::pair<float, float> &rng,
+        LeafFn leaf) const;
 private:
-    std::unique_ptr<BvhNode> left;
-    std::unique_ptr<BvhNode> right;
+    MappedArray<BvhLinearNode, 32> nodes;
+
+    // Only set after collapse (nodes is then cleared)
+    MappedArray<Bvh4Node, 64> wide;
+    AABB box;
 };
 
 
-class BvhLeaf : public BvhNode {
+// Bounding Volume Hierarchy
+class Bvh : public Object {
 public:
-    BvhLeaf(ForwardIt begin, ForwardIt end);
+    // Currently only supports triangle meshes
+    Bvh(const std::shared_ptr<const Mesh> &mesh, const BvhConfig &cfg = BvhConfig());
     bool intersect(
         const glm::vec3 &eye,
         const glm::vec3 &dir,
         HitRecord &hr,
         const std::pair<float, float> &rng) const;
+    bool occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const;
+    bool getBounds(AABB &box) const { box.update(tree.bounds()); return true; }
+
+    // Write the tree and packs to a cache file tagged with key, returns false on failure
+    bool save(const std::string &path, uint64_t key) const;
+
+    // Map a cache file saved for key and mesh, returns nullptr if missing or stale
+    static std::shared_ptr<Bvh> load(const std::string &path, uint64_t key, const std::shared_ptr<const Mesh> &mesh);
 private:
-    std::vector<std::shared_ptr<Triangle>> mesh;
+    Bvh() { }
+
+    BvhTree tree;
+    std::shared_ptr<const Mesh> mesh;
+
+    // Leaves reference ranges of packs (each holding up to TRIPACK_WIDTH mesh triangles)
+    MappedArray<TriPack, 16> packs;
 };
 
 
-// Bounding Volume Hierarchy
-class Bvh : public Object {
+// Hierarchy over objects (each of which may have its own Bvh), ie. the scene or the shapes of a model
+class SceneBvh : public Object {
 public:
-    // Currently only supports triangle meshes
-    // NB: std::partition is used, so mesh will be mutated, but this is _okay_
-    Bvh(std::vector<std::shared_ptr<Triangle>> &mesh);
+    SceneBvh(const std::vector<std::shared_ptr<Object>> &objs, const BvhConfig &cfg = BvhConfig());
     bool intersect(
         const glm::vec3 &eye,
         const glm::vec3 &dir,
         HitRecord &hr,
-        const std::pair<float, float> &rng) const { return root->intersect(eye, dir, hr, rng); }
+        const std::pair<float, float> &rng) const;
+    bool occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const;
+    bool getBounds(AABB &box) const;
+
+    size_t numBounded() const { return objs.size(); }
+    size_t numUnbounded() const { return unbounded.size(); }
 private:
-    std::unique_ptr<BvhNode> root;
+    BvhTree tree;
+
+    // Bounded objects in leaf order
+    std::vector<std::shared_ptr<Object>> objs;
+
+    // Objects without bounds (eg. planes) are always tested
+    std::vector<std::shared_ptr<Object>> unbounded;
 };
+
+
+// Slab test against a node using precomputed reciprocal direction
+// NB: Returns the entry distance into the node, or infinity if it misses within rng
+static inline float entryT(
+    const BvhLinearNode &node,
+    const glm::vec3 &eye,
+    const glm::vec3 &invDir,
+    const std::pair<float, float> &rng)
+{
+    BVH_STAT(nodeVisits);
+    auto t0 = (node.lo - eye) * invDir;
+    auto t1 = (node.hi - eye) * invDir;
+    auto tmin = glm::min(t0, t1), tmax = glm::max(t0, t1);
+    float enter = std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, rng.first));
+    float exit = std::min(std::min(tmax.x, tmax.y), std::min(tmax.z, rng.second));
+    return enter <= exit ? enter : std::numeric_limits<float>::infinity();
+}
+
+template <typename RemapFn>
+void BvhTree::remapLeaves(RemapFn f) {
+    for (auto &node : nodes.owned()) {
+        if (node.count > 0) {
+            auto r = f(node.offset, node.count);
+            node.offset = r.first;
+            node.count = r.second;
+        }
+    }
+    for (auto &node : wide.owned()) {
+        for (uint k = 0; k < 4; ++k) {
+            if (node.count[k] > 0) {
+                auto r = f(node.child[k], node.count[k]);
+                node.child[k] = r.first;
+                node.count[k] = r.second;
+            }
+        }
+    }
+}
+
+// Slab test of all four children, sets the entry distance of each and returns a bit mask of hits
+static inline int entryT4(
+    const Bvh4Node &node,
+    const glm::vec3 &eye,
+    const glm::vec3 &invDir,
+    const std::pair<float, float> &rng,
+    float tEnter[4])
+{
+    BVH_STAT(nodeVisits);
+#ifdef __SSE2__
+    __m128 enter = _mm_set1_ps(rng.first), exit = _mm_set1_ps(rng.second);
+    for (uint a = 0; a < 3; ++a) {
+        __m128 o = _mm_set1_ps(eye[a]), inv = _mm_set1_ps(invDir[a]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.lo[a]), o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.hi[a]), o), inv);
+        enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+        exit = _mm_min_ps(exit, _mm_max_ps(t0, t1));
+    }
+    _mm_storeu_ps(tEnter, enter);
+    return _mm_movemask_ps(_mm_cmple_ps(enter, exit));
+#else
+    int mask = 0;
+    for (uint k = 0; k < 4; ++k) {
+        float enter = rng.first, exit = rng.second;
+        for (uint a = 0; a < 3; ++a) {
+            float t0 = (node.lo[a][k] - eye[a]) * invDir[a], t1 = (node.hi[a][k] - eye[a]) * invDir[a];
+            enter = std::max(enter, std::min(t0, t1));
+            exit = std::min(exit, std::max(t0, t1));
+        }
+        tEnter[k] = enter;
+        mask |= (enter <= exit) << k;
+    }
+    return mask;
+#endif
+}
+
+template <typename LeafFn>
+void BvhTree::traverseWide(
+    const glm::vec3 &eye,
+    const glm::vec3 &dir,
+    std::pair<float, float> &rng,
+    LeafFn leaf) const
+{
+    // Deferred children (nodes or leaves) with their entry distance
+    struct Entry {
+        uint32_t child;
+        uint16_t count;
+        float t;
+    } stack[3*BVH_MAX_DEPTH + 1];
+    uint sp = 0;
+    stack[sp++] = {0, 0, rng.first};
+
+    auto invDir = 1.0f / dir;
+    while (sp > 0) {
+        // NB: rng.second is the closest hit so far, skip anything entered beyond it
+        auto e = stack[--sp];
+        if (e.t > rng.second)
+            continue;
+        if (e.count > 0) {
+            if (leaf(e.child, e.count))
+                break;
+            continue;
+        }
+
+        const auto &node = wide[e.child];
+        float tEnter[4];
+        int mask = entryT4(node, eye, invDir, rng, tEnter);
+
+        // Push hit children farthest first so the nearest is visited next
+        uint base = sp;
+        for (uint k = 0; k < 4; ++k) {
+            if (!(mask & (1 << k)) || node.child[k] == BVH4_EMPTY)
+                continue;
+            Entry c = {node.child[k], node.count[k], tEnter[k]};
+            uint i = sp++;
+            while (i > base && stack[i - 1].t < c.t) {
+                stack[i] = stack[i - 1];
+                i--;
+            }
+            stack[i] = c;
+        }
+    }
+}
+
+template <typename LeafFn>
+void BvhTree::traverse(
+    const glm::vec3 &eye,
+    const glm::vec3 &dir,
+    std::pair<float, float> &rng,
+    LeafFn leaf) const
+{
+    if (!wide.empty()) {
+        traverseWide(eye, dir, rng, leaf);
+        return;
+    }
+    if (nodes.empty())
+        return;
+
+    auto invDir = 1.0f / dir;
+    bool dirNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+    uint32_t stack[BVH_MAX_DEPTH];
+    uint sp = 0;
+    uint32_t idx = 0;
+    while (true) {
+        // NB: rng.second is the closest hit so far, so this also culls nodes entered beyond it
+        const auto &node = nodes[idx];
+        if (entryT(node, eye, invDir, rng) <= rng.second) {
+            if (node.count > 0) {
+                if (leaf(node.offset, node.count))
+                    break;
+            } else {
+                // Visit the child nearer along the split axis first, so its hits cull the other
+                if (dirNeg[node.axis]) {
+                    stack[sp++] = idx + 1;
+                    idx = node.offset;
+                } else {
+                    stack[sp++] = node.offset;
+                    idx = idx + 1;
+                }
+                continue;
+            }
+        }
+
+        if (sp == 0)
+            break;
+        idx = stack[--sp];
+    }
+}
 #endif
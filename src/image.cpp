@@ -1,7 +1,9 @@
 #include "image.hpp"
+#include "threadpool.hpp"
 
 #include <iostream>
 #include <cstring>
+#include <algorithm>
 #include <lodepng/lodepng.h>
 
 const uint Image::m_colorComponents = 3; // Red, blue, green
@@ -101,16 +103,21 @@ bool Image::savePng(const std::string & filename) const
 
 	image.resize(m_width * m_height * m_colorComponents);
 
-	double color;
-	for (uint y(0); y < m_height; y++) {
-		for (uint x(0); x < m_width; x++) {
-			for (uint i(0); i < m_colorComponents; ++i) {
-				color = m_data[m_colorComponents * (m_width * y + x) + i];
-				color = clamp(color, 0.0, 1.0);
-				image[m_colorComponents * (m_width * y + x) + i] = (unsigned char)(255 * color);
+	// Quantize bands of rows on the thread pool (lodepng's encoder itself is single threaded)
+	auto &pool = ThreadPool::global();
+	uint bands = std::min(pool.size(), m_height);
+	pool.parallelFor(bands, [&](uint band) {
+		double color;
+		for (uint y(band * m_height / bands); y < (band + 1) * m_height / bands; y++) {
+			for (uint x(0); x < m_width; x++) {
+				for (uint i(0); i < m_colorComponents; ++i) {
+					color = m_data[m_colorComponents * (m_width * y + x) + i];
+					color = clamp(color, 0.0, 1.0);
+					image[m_colorComponents * (m_width * y + x) + i] = (unsigned char)(255 * color);
+				}
 			}
 		}
-	}
+	});
 
 	// Encode the image
 	unsigned error = lodepng::encode(filename, image, m_width, m_height, LCT_RGB);
@@ -0,0 +1,63 @@
+#include "instance.hpp"
+
+using namespace std;
+
+Instance::Instance(const shared_ptr<Object> &model, const glm::mat4 &xform) :
+    model(model),
+    toModel(glm::inverse(xform)),
+    normToWorld(glm::transpose(glm::inverse(glm::mat3(xform))))
+{
+    // World bounds are the bounds of the transformed corners of the model's
+    AABB mb;
+    model->getBounds(mb);
+    for (uint i = 0; i < 8; ++i) {
+        glm::vec3 corner(
+            i & 1 ? mb.x.second : mb.x.first,
+            i & 2 ? mb.y.second : mb.y.first,
+            i & 4 ? mb.z.second : mb.z.first);
+        box.update(glm::vec3(xform*glm::vec4(corner, 1.0f)));
+    }
+}
+
+bool Instance::intersect(
+    const glm::vec3 &eye,
+    const glm::vec3 &dir,
+    HitRecord &hr,
+    const std::pair<float, float> &rng) const
+{
+    // Model space distances are world ones scaled by the length of the transformed direction
+    auto d = glm::mat3(toModel)*dir;
+    float s = glm::length(d), t = hr.t;
+    hr.t = t*s;
+    model->intersect(glm::vec3(toModel*glm::vec4(eye, 1.0f)), d/s, hr, make_pair(rng.first*s, rng.second*s));
+    if (hr.t < t*s) {
+        hr.t /= s;
+        hr.inst = this;
+    } else {
+        hr.t = t;
+    }
+    return hr.surf != nullptr;
+}
+
+bool Instance::occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const {
+    auto d = glm::mat3(toModel)*dir;
+    float s = glm::length(d);
+    return model->occluded(glm::vec3(toModel*glm::vec4(eye, 1.0f)), d/s, tmax*s);
+}
+
+void Instance::finalize(HitRecord &hr) const {
+    // Surfaces finalize against the model space ray
+    auto eye = hr.eye, dir = hr.dir;
+    float t = hr.t;
+    hr.dir = glm::mat3(toModel)*dir;
+    hr.eye = glm::vec3(toModel*glm::vec4(eye, 1.0f));
+    hr.t *= glm::length(hr.dir);
+    hr.dir = glm::normalize(hr.dir);
+    hr.surf->finalize(hr);
+    hr.eye = eye;
+    hr.dir = dir;
+    hr.t = t;
+
+    // NB: Keeps the length of the interpolated normal, as it would be had the mesh been transformed
+    hr.norm = glm::normalize(normToWorld*hr.norm)*glm::length(hr.norm);
+}
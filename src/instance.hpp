@@ -0,0 +1,37 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "surface.hpp"
+#include "aabb.hpp"
+
+#include <glm/glm.hpp>
+#include <memory>
+
+// A shared model placed in the world by an affine transform
+// NB: Rays are moved into model space rather than the model's vertices into world space, so any
+// number of instances share one copy of the model (and of its Bvhs)
+class Instance : public Object {
+public:
+    Instance(const std::shared_ptr<Object> &model, const glm::mat4 &xform);
+    virtual ~Instance() { }
+
+    bool intersect(
+        const glm::vec3 &eye,
+        const glm::vec3 &dir,
+        HitRecord &hr,
+        const std::pair<float, float> &rng) const;
+    bool occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const;
+    bool getBounds(AABB &box) const { box.update(this->box); return true; }
+
+    // Finalize a hit inside this instance (ie. hr.inst) with world space shading attributes
+    void finalize(HitRecord &hr) const;
+private:
+    std::shared_ptr<Object> model;
+
+    // NB: Model space rays are renormalized (surfaces expect unit directions, and triangle tests
+    // have an absolute epsilon), so hit distances are scaled in and out of model space
+    glm::mat4 toModel;
+    glm::mat3 normToWorld;
+    AABB box;
+};
+#endif
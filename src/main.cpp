@@ -11,6 +11,8 @@
 #include "objobject.hpp"
 #include "transform.hpp"
 #include "parser.hpp"
+#include "tripack.hpp"
+#include "threadpool.hpp"
 
 #include "tiny_obj_loader.h"
 #include "CLI11.hpp"
@@ -27,10 +29,48 @@ int main(int ac, char *av[])
     app.add_option("-f,--file,file", file_name, "Output file name");
     app.add_option("-t,--thread,thread", num_threads, "Number of threads");
     app.add_option("-i,--input,input", input_file, "Input json file name");
+    uint tile_size = 0;
+    auto tile_size_opt = app.add_option("--tile-size", tile_size, "Side of the pixel tiles render threads share");
+    string tile_order;
+    auto tile_order_opt = app.add_option("--tile-order", tile_order, "Order tiles are issued in (rows, morton, hilbert)");
+    string sampling;
+    uint max_samples = 0;
+    float noise_threshold = 0;
+    auto sampling_opt = app.add_option("--sampling", sampling, "Primary ray sampling (fixed, adaptive, progressive)");
+    auto max_samples_opt = app.add_option("--max-samples", max_samples, "Most primary rays per pixel when adaptive");
+    auto noise_threshold_opt = app.add_option("--noise-threshold", noise_threshold, "Standard error of a converged pixel's luminance");
+    bool adaptive_shadows = true;
+    auto adaptive_shadows_opt = app.add_option("--adaptive-shadows", adaptive_shadows, "Cast more shadow rays only in penumbrae (1) or always (0)");
+    bool decoupled = false;
+    auto decoupled_opt = app.add_option("--decoupled", decoupled, "Shade once per surface per pixel (1) or per sample (0)");
+    string tile_cost;
+    auto tile_cost_opt = app.add_option("--tile-cost", tile_cost, "Tile cost estimate to start expensive tiles first (none, prepass, previous)");
+
+    // BVH build overrides (otherwise taken from "bvh" in the scene config)
+    string bvh_split;
+    uint bvh_bins = 0;
+    float bvh_leaf_cost = 0;
+    auto bvh_split_opt = app.add_option("--bvh-split", bvh_split, "BVH split method (sah, mean, lbvh, hlbvh, sbvh)");
+    auto bvh_bins_opt = app.add_option("--bvh-bins", bvh_bins, "Number of SAH bins");
+    auto bvh_leaf_cost_opt = app.add_option("--bvh-leaf-cost", bvh_leaf_cost, "SAH cost of a triangle test");
+    string bvh_cache;
+    auto bvh_cache_opt = app.add_option("--bvh-cache", bvh_cache, "Directory to cache built mesh BVHs in");
+    uint bvh_width = 0;
+    auto bvh_width_opt = app.add_option("--bvh-width", bvh_width, "BVH node width (2, 4)");
+    bool bvh_lazy = true;
+    auto bvh_lazy_opt = app.add_option("--bvh-lazy", bvh_lazy, "Build mesh BVHs when first hit (1) or at load (0)");
+    string tri_kernel = "auto";
+    app.add_option("--tri-kernel", tri_kernel, "BVH leaf triangle kernel (auto, scalar, sse, avx2)");
 
     try {
         app.parse(ac, av);
         cout << "Using " << num_threads << " threads" << endl;
+        ThreadPool::setGlobalThreads(num_threads);
+        if (!setTriPackKernel(tri_kernel)) {
+            cerr << "Unsupported triangle kernel: " << tri_kernel << endl;
+            return 1;
+        }
+        cout << "Using " << triPackKernel().name << " triangle kernel" << endl;
     } catch(const CLI::Error &e) {
         return app.exit(e);
     } catch(...) {
@@ -51,9 +91,64 @@ int main(int ac, char *av[])
     doc.Parse(file_str.c_str());
 
     RayTracer rt = parseSceneCamera(doc, num_threads);
+    if (tile_size_opt->count()) {
+        rt.setTileSize(tile_size);
+    }
+    if (tile_order_opt->count() && !rt.setTileOrder(tile_order)) {
+        cerr << "Unknown tile order: " << tile_order << endl;
+        return 1;
+    }
+    if (tile_cost_opt->count() && !rt.setTileCost(tile_cost)) {
+        cerr << "Unknown tile cost: " << tile_cost << endl;
+        return 1;
+    }
     auto dim = parseImageDim(doc);
+    auto sampleCfg = parseSampleConfig(doc);
+    if (sampling_opt->count() && !sampleCfg.setMode(sampling)) {
+        cerr << "Unknown sampling mode: " << sampling << endl;
+        return 1;
+    }
+    if (max_samples_opt->count()) {
+        sampleCfg.maxSamples = max_samples;
+    }
+    if (noise_threshold_opt->count()) {
+        sampleCfg.threshold = noise_threshold;
+    }
+    if (adaptive_shadows_opt->count()) {
+        sampleCfg.adaptiveShadows = adaptive_shadows;
+    }
+    if (decoupled_opt->count()) {
+        sampleCfg.decoupled = decoupled;
+    }
+    rt.setSampling(sampleCfg);
     auto mtl = parseMaterials(doc);
-    auto objs = parseScene(doc, mtl);
+    auto bvhCfg = parseBvhConfig(doc);
+    bvhCfg.threads = num_threads;
+    if (bvh_cache_opt->count()) {
+        bvhCfg.cacheDir = bvh_cache;
+    }
+    if (bvh_split_opt->count() && !bvhCfg.setSplit(bvh_split)) {
+        cerr << "Unknown BVH split: " << bvh_split << endl;
+        return 1;
+    }
+    if (bvh_bins_opt->count()) {
+        bvhCfg.bins = bvh_bins;
+    }
+    if (bvh_leaf_cost_opt->count()) {
+        bvhCfg.leafCost = bvh_leaf_cost;
+    }
+    if (bvh_lazy_opt->count()) {
+        bvhCfg.lazy = bvh_lazy;
+    }
+    if (bvh_width_opt->count() && !bvhCfg.setWidth(bvh_width)) {
+        cerr << "Unsupported BVH width: " << bvh_width << endl;
+        return 1;
+    }
+    rt.setBvhConfig(bvhCfg);
+    auto loadBegin = chrono::high_resolution_clock::now();
+    auto objs = parseScene(doc, mtl, bvhCfg);
+    auto loadEnd = chrono::high_resolution_clock::now();
+    cout << "Scene loaded in " << chrono::duration_cast<std::chrono::milliseconds>(loadEnd-loadBegin).count() << " ms" << endl;
     Image img(dim.first, dim.second);
     cout << "Using config: " << input_file << endl;
     cout << "Render resolution: " << dim.first << " x " << dim.second << endl;
@@ -74,6 +169,9 @@ int main(int ac, char *av[])
     auto end = chrono::high_resolution_clock::now();
 
     cout << "Time elapsed: " << chrono::duration_cast<std::chrono::seconds>(end-begin).count() << " s" << endl;
+#ifdef BVH_STATS
+    BvhStats::print();
+#endif
     img.savePng(file_name);
     cout << "Saved image to " << file_name  << endl;
     return 0;
@@ -0,0 +1,43 @@
+#include "mappedfile.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+
+using namespace std;
+
+MappedFile::~MappedFile() {
+    if (ptr != nullptr) {
+        munmap(const_cast<uint8_t *>(ptr), len);
+    }
+}
+
+shared_ptr<const MappedFile> MappedFile::open(const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    // NB: The mapping stays valid after closing the descriptor
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return nullptr;
+
+    shared_ptr<MappedFile> file(new MappedFile());
+    file->ptr = static_cast<const uint8_t *>(p);
+    file->len = st.st_size;
+    return file;
+}
+
+string MappedFile::tempPath(const string &path) {
+    static atomic<unsigned long> counter(0);
+    return path + "." + to_string(getpid()) + "." + to_string(counter++) + ".tmp";
+}
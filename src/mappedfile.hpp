@@ -0,0 +1,77 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include "aligned.hpp"
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+// Read only memory mapping of a whole file (unmapped once the last reference goes)
+class MappedFile {
+public:
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // Returns nullptr if the file cannot be opened or mapped
+    static std::shared_ptr<const MappedFile> open(const std::string &path);
+
+    // Unique name next to path (per process and call) to write a file under before renaming it to path,
+    // so readers never map a partial file and concurrent writers never share one
+    static std::string tempPath(const std::string &path);
+
+    const uint8_t *data() const { return ptr; }
+    size_t size() const { return len; }
+private:
+    MappedFile() : ptr(nullptr), len(0) { }
+
+    const uint8_t *ptr;
+    size_t len;
+};
+
+
+// Read only array that either owns its elements or views them in place (eg. inside a MappedFile)
+// NB: Not copyable since the view would dangle, moving keeps the owned buffer (and so the view)
+template <typename T, size_t Align = alignof(T)>
+class MappedArray {
+public:
+    MappedArray() : ptr(nullptr), n(0) { }
+    MappedArray(MappedArray &&) = default;
+    MappedArray &operator=(MappedArray &&) = default;
+    MappedArray(const MappedArray &) = delete;
+    MappedArray &operator=(const MappedArray &) = delete;
+
+    const T &operator[](size_t i) const { return ptr[i]; }
+    const T *data() const { return ptr; }
+    const T *begin() const { return ptr; }
+    const T *end() const { return ptr + n; }
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+
+    // Take ownership of built elements, which can still be edited in place through owned()
+    void assign(aligned_vector<T, Align> &&v) {
+        own = std::move(v);
+        source.reset();
+        ptr = own.data();
+        n = own.size();
+    }
+    aligned_vector<T, Align> &owned() { return own; }
+
+    // View count elements at p inside owner (eg. a file, which stays mapped while viewed)
+    void view(const std::shared_ptr<const void> &owner, const T *p, size_t count) {
+        own.clear();
+        own.shrink_to_fit();
+        source = owner;
+        ptr = p;
+        n = count;
+    }
+
+    void clear() { assign(aligned_vector<T, Align>()); }
+private:
+    aligned_vector<T, Align> own;
+    std::shared_ptr<const void> source;
+    const T *ptr;
+    size_t n;
+};
+#endif
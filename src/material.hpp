@@ -20,5 +20,5 @@ public:
     float p;
 };
 
-typedef std::shared_ptr<Material> MaterialPtr;
+typedef std::shared_ptr<const Material> MaterialPtr;
 #endif
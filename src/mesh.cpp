@@ -0,0 +1,87 @@
+#include "mesh.hpp"
+
+using namespace std;
+
+AABB Mesh::triBounds(uint32_t tri) const {
+    AABB box;
+    box.update(pos(tri, 0));
+    box.update(pos(tri, 1));
+    box.update(pos(tri, 2));
+    return box;
+}
+
+bool Mesh::intersect(
+    uint32_t tri,
+    const glm::vec3 &eye,
+    const glm::vec3 &dir,
+    HitRecord &hr,
+    const std::pair<float, float> &rng) const
+{
+    const auto &a = pos(tri, 0);
+    float t, beta, gamma;
+    if (!hitTriangle(a, a - pos(tri, 1), a - pos(tri, 2), true, eye, dir, rng, t, beta, gamma))
+        return false;
+
+    // Assign t iff smaller than current t (intersect closer)
+    if (t < hr.t) {
+        hr.t = t;
+        hr.surf = this;
+        hr.inst = nullptr;
+        hr.prim = tri;
+        hr.bary = glm::vec2(beta, gamma);
+        return true;
+    }
+    return false;
+}
+
+bool Mesh::occluded(uint32_t tri, const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const {
+    const auto &a = pos(tri, 0);
+    float t, beta, gamma;
+    return hitTriangle(a, a - pos(tri, 1), a - pos(tri, 2), true, eye, dir, make_pair(0.0f, tmax), t, beta, gamma);
+}
+
+bool Mesh::intersect(
+    const glm::vec3 &eye,
+    const glm::vec3 &dir,
+    HitRecord &hr,
+    const std::pair<float, float> &rng) const
+{
+    bool hit = false;
+    for (uint32_t i = 0; i < numTriangles(); ++i) {
+        hit |= intersect(i, eye, dir, hr, rng);
+    }
+    return hit;
+}
+
+bool Mesh::occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const {
+    for (uint32_t i = 0; i < numTriangles(); ++i) {
+        if (occluded(i, eye, dir, tmax))
+            return true;
+    }
+    return false;
+}
+
+shared_ptr<Mesh> Mesh::share(const shared_ptr<const Mesh> &mesh) {
+    auto m = make_shared<Mesh>();
+    m->positions.view(mesh, mesh->positions.data(), mesh->positions.size());
+    m->normals.view(mesh, mesh->normals.data(), mesh->normals.size());
+    m->uvs.view(mesh, mesh->uvs.data(), mesh->uvs.size());
+    m->indices.view(mesh, mesh->indices.data(), mesh->indices.size());
+    m->matIds.view(mesh, mesh->matIds.data(), mesh->matIds.size());
+    return m;
+}
+
+bool Mesh::getBounds(AABB &box) const {
+    for (const auto &p : positions) {
+        box.update(p);
+    }
+    return true;
+}
+
+void Mesh::finalize(HitRecord &hr) const {
+    auto i = &indices[3*hr.prim];
+    float alpha = 1 - hr.bary.x - hr.bary.y;
+    hr.norm = normals[i[0]]*alpha + normals[i[1]]*hr.bary.x + normals[i[2]]*hr.bary.y;
+    hr.uv = uvs[i[0]]*alpha + uvs[i[1]]*hr.bary.x + uvs[i[2]]*hr.bary.y;
+    hr.mat = materials[matIds[hr.prim]].get();
+}
@@ -0,0 +1,65 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "surface.hpp"
+#include "triangle.hpp"
+#include "mappedfile.hpp"
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+// Alignment of built mesh arrays (posix_memalign needs at least pointer alignment)
+#define MESH_ALIGN 16
+
+// Indexed triangle mesh, vertex attributes are stored as separate arrays shared by all triangles
+// NB: A hit on a mesh sets hr.prim to the triangle index. Arrays are either built (eg. from an obj
+// file) or used in place from a mapped mesh file (see meshfile.hpp).
+class Mesh : public Surface {
+public:
+    Mesh() : Surface(nullptr) { }
+    virtual ~Mesh() { }
+
+    uint32_t numTriangles() const { return matIds.size(); }
+    uint32_t numVertices() const { return positions.size(); }
+
+    // Per triangle geometry
+    const glm::vec3 &pos(uint32_t tri, uint k) const { return positions[indices[3*tri + k]]; }
+    glm::vec3 centroid(uint32_t tri) const { return (pos(tri, 0) + pos(tri, 1) + pos(tri, 2)) / 3.f; }
+    AABB triBounds(uint32_t tri) const;
+
+    // Test a single triangle, updates hr iff closer
+    bool intersect(
+        uint32_t tri,
+        const glm::vec3 &eye,
+        const glm::vec3 &dir,
+        HitRecord &hr,
+        const std::pair<float, float> &rng) const;
+    bool occluded(uint32_t tri, const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const;
+
+    // Linear search over all triangles (see Bvh)
+    bool intersect(
+        const glm::vec3 &eye,
+        const glm::vec3 &dir,
+        HitRecord &hr,
+        const std::pair<float, float> &rng) const;
+    bool occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const;
+    bool getBounds(AABB &box) const;
+    void finalize(HitRecord &hr) const;
+
+    // New mesh viewing the geometry of mesh (which it keeps alive), with its own materials
+    static std::shared_ptr<Mesh> share(const std::shared_ptr<const Mesh> &mesh);
+public:
+    // Vertex attributes
+    MappedArray<glm::vec3, MESH_ALIGN> positions;
+    MappedArray<glm::vec3, MESH_ALIGN> normals;
+    MappedArray<glm::vec2, MESH_ALIGN> uvs;
+
+    // Three vertex indices and one material index per triangle
+    MappedArray<uint32_t, MESH_ALIGN> indices;
+    MappedArray<uint16_t, MESH_ALIGN> matIds;
+    std::vector<MaterialPtr> materials;
+};
+
+typedef std::shared_ptr<Mesh> MeshPtr;
+#endif
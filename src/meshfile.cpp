@@ -0,0 +1,164 @@
+#include "meshfile.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+
+using namespace std;
+
+static_assert(sizeof(glm::vec3) == 3*sizeof(float), "Mesh file positions are stored as packed glm::vec3");
+static_assert(sizeof(glm::vec2) == 2*sizeof(float), "Mesh file uvs are stored as packed glm::vec2");
+
+// Arrays are stored as they are in memory
+static bool littleEndian() {
+    uint32_t v = 1;
+    return *reinterpret_cast<const uint8_t *>(&v) == 1;
+}
+
+static uint64_t meshAlign(uint64_t offset) {
+    return (offset + MESHFILE_ALIGN - 1) / MESHFILE_ALIGN * MESHFILE_ALIGN;
+}
+
+bool writeMeshFile(const string &path, const vector<MeshPtr> &meshes, const vector<MeshFileMaterial> &mtls) {
+    if (!littleEndian()) {
+        cerr << "Error writeMeshFile: only little endian hosts are supported" << endl;
+        return false;
+    }
+
+    // Lay out the header, tables and then each shape's arrays
+    MeshFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MESHFILE_MAGIC, sizeof(h.magic));
+    h.version = MESHFILE_VERSION;
+    h.shapeCount = meshes.size();
+    h.materialCount = mtls.size();
+    h.materialOffset = meshAlign(sizeof(h));
+    h.shapeOffset = meshAlign(h.materialOffset + mtls.size()*sizeof(MeshFileMaterial));
+
+    vector<MeshFileShape> shapes(meshes.size());
+    uint64_t offset = h.shapeOffset + shapes.size()*sizeof(MeshFileShape);
+    for (size_t s = 0; s < meshes.size(); ++s) {
+        const auto &m = *meshes[s];
+        auto &sh = shapes[s];
+        sh.vertexCount = m.numVertices();
+        sh.triangleCount = m.numTriangles();
+        sh.positionOffset = meshAlign(offset);
+        sh.normalOffset = meshAlign(sh.positionOffset + sh.vertexCount*sizeof(glm::vec3));
+        sh.uvOffset = meshAlign(sh.normalOffset + sh.vertexCount*sizeof(glm::vec3));
+        sh.indexOffset = meshAlign(sh.uvOffset + sh.vertexCount*sizeof(glm::vec2));
+        sh.matIdOffset = meshAlign(sh.indexOffset + 3*sh.triangleCount*sizeof(uint32_t));
+        offset = sh.matIdOffset + sh.triangleCount*sizeof(uint16_t);
+    }
+
+    // NB: Written under a unique temporary name and renamed, so readers never map a partial file
+    auto tmp = MappedFile::tempPath(path);
+    ofstream out(tmp, ios::binary);
+    auto put = [&out](uint64_t offset, const void *data, size_t n) {
+        static const char zeros[MESHFILE_ALIGN] = {};
+        out.write(zeros, offset - out.tellp());
+        out.write(static_cast<const char *>(data), n);
+    };
+    out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    put(h.materialOffset, mtls.data(), mtls.size()*sizeof(MeshFileMaterial));
+    put(h.shapeOffset, shapes.data(), shapes.size()*sizeof(MeshFileShape));
+    for (size_t s = 0; s < meshes.size(); ++s) {
+        const auto &m = *meshes[s];
+        const auto &sh = shapes[s];
+        put(sh.positionOffset, m.positions.data(), sh.vertexCount*sizeof(glm::vec3));
+        put(sh.normalOffset, m.normals.data(), sh.vertexCount*sizeof(glm::vec3));
+        put(sh.uvOffset, m.uvs.data(), sh.vertexCount*sizeof(glm::vec2));
+        put(sh.indexOffset, m.indices.data(), 3*sh.triangleCount*sizeof(uint32_t));
+        put(sh.matIdOffset, m.matIds.data(), sh.triangleCount*sizeof(uint16_t));
+    }
+    out.close();
+    if (!out || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        cerr << "Error writeMeshFile: cannot write " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+bool readMeshFile(
+    const string &path,
+    const Transform &xform,
+    vector<MeshPtr> &meshes,
+    vector<MeshFileMaterial> &mtls)
+{
+    auto file = MappedFile::open(path);
+    if (file == nullptr || file->size() < sizeof(MeshFileHeader) || !littleEndian()) {
+        cerr << "Error readMeshFile: cannot map " << path << endl;
+        return false;
+    }
+
+    // Every array must be aligned and lie inside the file
+    auto base = file->data();
+    auto fits = [&file](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset % MESHFILE_ALIGN == 0 && offset <= file->size() && count <= (file->size() - offset) / size;
+    };
+
+    MeshFileHeader h;
+    memcpy(&h, base, sizeof(h));
+    if (memcmp(h.magic, MESHFILE_MAGIC, sizeof(h.magic)) != 0 || h.version != MESHFILE_VERSION ||
+        !fits(h.materialOffset, h.materialCount, sizeof(MeshFileMaterial)) ||
+        !fits(h.shapeOffset, h.shapeCount, sizeof(MeshFileShape))) {
+        cerr << "Error readMeshFile: invalid or unsupported file " << path << endl;
+        return false;
+    }
+
+    auto fileMtls = reinterpret_cast<const MeshFileMaterial *>(base + h.materialOffset);
+    mtls.assign(fileMtls, fileMtls + h.materialCount);
+
+    bool identity = xform.matrix() == glm::mat4(1.0f);
+    auto shapes = reinterpret_cast<const MeshFileShape *>(base + h.shapeOffset);
+    for (uint32_t s = 0; s < h.shapeCount; ++s) {
+        const auto &sh = shapes[s];
+        if (!fits(sh.positionOffset, sh.vertexCount, sizeof(glm::vec3)) ||
+            !fits(sh.normalOffset, sh.vertexCount, sizeof(glm::vec3)) ||
+            !fits(sh.uvOffset, sh.vertexCount, sizeof(glm::vec2)) ||
+            !fits(sh.indexOffset, 3*uint64_t(sh.triangleCount), sizeof(uint32_t)) ||
+            !fits(sh.matIdOffset, sh.triangleCount, sizeof(uint16_t))) {
+            cerr << "Error readMeshFile: shape " << s << " is out of bounds in " << path << endl;
+            meshes.clear();
+            return false;
+        }
+
+        // Checked once here so shading can index vertices and materials without bounds checks
+        auto indices = reinterpret_cast<const uint32_t *>(base + sh.indexOffset);
+        auto matIds = reinterpret_cast<const uint16_t *>(base + sh.matIdOffset);
+        bool valid = true;
+        for (uint64_t i = 0; i < 3*uint64_t(sh.triangleCount) && valid; ++i) {
+            valid = indices[i] < sh.vertexCount;
+        }
+        for (uint32_t t = 0; t < sh.triangleCount && valid; ++t) {
+            valid = matIds[t] <= h.materialCount;
+        }
+        if (!valid) {
+            cerr << "Error readMeshFile: shape " << s << " has invalid indices in " << path << endl;
+            meshes.clear();
+            return false;
+        }
+
+        auto mesh = make_shared<Mesh>();
+        auto positions = reinterpret_cast<const glm::vec3 *>(base + sh.positionOffset);
+        auto normals = reinterpret_cast<const glm::vec3 *>(base + sh.normalOffset);
+        if (identity) {
+            mesh->positions.view(file, positions, sh.vertexCount);
+            mesh->normals.view(file, normals, sh.vertexCount);
+        } else {
+            aligned_vector<glm::vec3, MESH_ALIGN> p(sh.vertexCount), n(sh.vertexCount);
+            for (uint32_t i = 0; i < sh.vertexCount; ++i) {
+                p[i] = xform.pos(positions[i]);
+                n[i] = glm::normalize(xform.norm(normals[i]));
+            }
+            mesh->positions.assign(move(p));
+            mesh->normals.assign(move(n));
+        }
+        mesh->uvs.view(file, reinterpret_cast<const glm::vec2 *>(base + sh.uvOffset), sh.vertexCount);
+        mesh->indices.view(file, indices, 3*sh.triangleCount);
+        mesh->matIds.view(file, matIds, sh.triangleCount);
+        meshes.emplace_back(mesh);
+    }
+    return true;
+}
@@ -0,0 +1,55 @@
+#ifndef MESHFILE_H
+#define MESHFILE_H
+
+#include "mesh.hpp"
+#include "transform.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Binary mesh file (written by objconv), loaded by mapping it and using its arrays in place
+// NB: Little endian, every array starts on a MESHFILE_ALIGN boundary
+#define MESHFILE_EXT ".rtmesh"
+#define MESHFILE_MAGIC "RTMESH\0"
+#define MESHFILE_VERSION 1
+#define MESHFILE_ALIGN 64
+
+struct MeshFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t shapeCount;
+    uint32_t materialCount;
+    uint32_t pad;
+    uint64_t materialOffset;  // MeshFileMaterial[materialCount]
+    uint64_t shapeOffset;     // MeshFileShape[shapeCount]
+};
+
+// Obj mtl colors, a mesh matId of materialCount selects the scene's default material instead
+struct MeshFileMaterial {
+    float kd[3];
+    float ks[3];
+};
+
+// Arrays of one shape (positions/normals/uvs per vertex, 3 indices and a matId per triangle)
+struct MeshFileShape {
+    uint32_t vertexCount;
+    uint32_t triangleCount;
+    uint64_t positionOffset;  // float[3] each
+    uint64_t normalOffset;    // float[3] each
+    uint64_t uvOffset;        // float[2] each
+    uint64_t indexOffset;     // uint32_t[3] each
+    uint64_t matIdOffset;     // uint16_t each
+};
+
+// Write model space meshes and their material table, returns false on failure
+bool writeMeshFile(const std::string &path, const std::vector<MeshPtr> &meshes, const std::vector<MeshFileMaterial> &mtls);
+
+// Map a mesh file, returns false if it is missing or invalid
+// NB: Arrays are used in place, except positions and normals if xform is not the identity
+bool readMeshFile(
+    const std::string &path,
+    const Transform &xform,
+    std::vector<MeshPtr> &meshes,
+    std::vector<MeshFileMaterial> &mtls);
+#endif
@@ -0,0 +1,48 @@
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "objobject.hpp"
+#include "meshfile.hpp"
+#include "transform.hpp"
+
+#include "CLI11.hpp"
+
+using namespace std;
+
+// Convert an obj file (and its mtl materials) into a binary mesh file for fast loading
+int main(int ac, char *av[])
+{
+    string input_file, output_file, base_dir;
+    CLI::App app("Obj to binary mesh converter");
+    app.add_option("-i,--input,input", input_file, "Input obj file name")->required();
+    app.add_option("-o,--output,output", output_file, "Output mesh file name (" MESHFILE_EXT ")")->required();
+    app.add_option("-d,--dir", base_dir, "Directory of mtl files (defaults to the obj's)");
+
+    try {
+        app.parse(ac, av);
+    } catch(const CLI::Error &e) {
+        return app.exit(e);
+    }
+
+    if (base_dir.empty()) {
+        auto slash = input_file.find_last_of('/');
+        base_dir = slash == string::npos ? "./" : input_file.substr(0, slash + 1);
+    }
+
+    // NB: Meshes are stored in model space, scenes apply their own transforms when loading
+    vector<MeshPtr> meshes;
+    vector<MeshFileMaterial> mtls;
+    if (!ObjObject::loadMeshes(input_file, base_dir, Transform(), thread::hardware_concurrency(), meshes, mtls))
+        return 1;
+    if (!writeMeshFile(output_file, meshes, mtls))
+        return 1;
+
+    size_t tris = 0;
+    for (const auto &m : meshes) {
+        tris += m->numTriangles();
+    }
+    cout << "Wrote " << meshes.size() << " shapes (" << tris << " triangles, "
+         << mtls.size() << " materials) to " << output_file << endl;
+    return 0;
+}
@@ -0,0 +1,474 @@
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+#include "objfile.hpp"
+#include "mappedfile.hpp"
+#include "transform.hpp"
+#include "threadpool.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include <atomic>
+#include <cstring>
+#include <cmath>
+#include <climits>
+#include <map>
+
+using namespace std;
+
+
+// Face corner, indices are 0 based and -1 if missing
+struct ObjCorner {
+    int v, vt, vn;
+};
+
+enum ObjEventType { OBJ_GROUP, OBJ_USEMTL, OBJ_MTLLIB };
+
+// Statement applying to the triangles after it (tri of them come before it in its chunk)
+struct ObjEvent {
+    ObjEventType type;
+    size_t tri;
+    string arg;
+};
+
+// Everything parsed from one chunk (of whole lines) of the file
+// NB: Negative indices count back from the end of the chunk so far, relative lists the corners
+// (and a mask of which of v, vt, vn) that still need the counts of earlier chunks added
+struct ObjChunk {
+    ObjChunk() : bad(false) { }
+
+    vector<glm::vec3> v, vn;
+    vector<glm::vec2> vt;
+    vector<ObjCorner> corners;  // 3 per triangle
+    vector<pair<size_t, uint8_t>> relative;
+    vector<ObjEvent> events;
+    bool bad;
+};
+
+static inline bool isSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline const char *skipSpace(const char *p, const char *end) {
+    while (p < end && isSpace(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+// True if the line at p starts with keyword kw followed by a space
+static inline bool keyword(const char *p, const char *end, const char *kw) {
+    size_t n = strlen(kw);
+    return size_t(end - p) > n && memcmp(p, kw, n) == 0 && isSpace(p[n]);
+}
+
+// NB: strtof needs a terminated string (the mapped file is not), so parse the decimal by hand,
+// exact powers of ten keep it within an ulp of strtof for anything an obj exporter writes
+static const char *parseFloat(const char *p, const char *end, float &f) {
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    p = skipSpace(p, end);
+    bool neg = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        ++p;
+    }
+    double m = 0;
+    int exp = 0;
+    for (; p < end && isDigit(*p); ++p) {
+        m = 10*m + (*p - '0');
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && isDigit(*p); ++p) {
+            m = 10*m + (*p - '0');
+            --exp;
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool eneg = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+')) {
+            ++p;
+        }
+        int e = 0;
+        for (; p < end && isDigit(*p); ++p) {
+            e = min(10*e + (*p - '0'), 1000);
+        }
+        exp += eneg ? -e : e;
+    }
+    if (exp > 22 || exp < -22) {
+        m *= pow(10.0, exp);
+    } else if (exp < 0) {
+        m /= pow10[-exp];
+    } else {
+        m *= pow10[exp];
+    }
+    f = static_cast<float>(neg ? -m : m);
+    return p;
+}
+
+static const char *parseInt(const char *p, const char *end, int &i) {
+    bool neg = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        ++p;
+    }
+    i = 0;
+    for (; p < end && isDigit(*p); ++p) {
+        i = 10*i + (*p - '0');
+    }
+    i = neg ? -i : i;
+    return p;
+}
+
+// Make a 1 based (or negative, counting back from n) index 0 based, sets rel if negative
+static inline int fixIndex(int idx, size_t n, uint8_t bit, uint8_t &rel, bool &bad) {
+    if (idx > 0) {
+        return idx - 1;
+    }
+    if (idx == 0) {
+        bad = true;
+        return -1;
+    }
+    rel |= bit;
+    return static_cast<int>(n) + idx;
+}
+
+static void parseChunk(const char *p, const char *end, ObjChunk &c) {
+    // Rough guess of ~32 bytes per line keeps regrowing down
+    size_t guess = (end - p)/32;
+    c.v.reserve(guess/2);
+    c.corners.reserve(3*guess/2);
+
+    vector<ObjCorner> face;
+    vector<uint8_t> faceRel;
+    while (p < end) {
+        auto eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (eol == nullptr) {
+            eol = end;
+        }
+        auto line = skipSpace(p, eol);
+        auto lineEnd = eol;
+        if (lineEnd > line && lineEnd[-1] == '\r') {
+            --lineEnd;
+        }
+        p = eol < end ? eol + 1 : end;
+        if (line == lineEnd || line[0] == '#') {
+            continue;
+        }
+
+        if (keyword(line, lineEnd, "v")) {
+            glm::vec3 x;
+            auto q = parseFloat(line + 2, lineEnd, x.x);
+            q = parseFloat(q, lineEnd, x.y);
+            parseFloat(q, lineEnd, x.z);
+            c.v.emplace_back(x);
+        } else if (keyword(line, lineEnd, "vn")) {
+            glm::vec3 x;
+            auto q = parseFloat(line + 3, lineEnd, x.x);
+            q = parseFloat(q, lineEnd, x.y);
+            parseFloat(q, lineEnd, x.z);
+            c.vn.emplace_back(x);
+        } else if (keyword(line, lineEnd, "vt")) {
+            glm::vec2 x;
+            auto q = parseFloat(line + 3, lineEnd, x.x);
+            parseFloat(q, lineEnd, x.y);
+            c.vt.emplace_back(x);
+        } else if (keyword(line, lineEnd, "f")) {
+            // Corners are v, v/vt, v//vn or v/vt/vn
+            face.clear();
+            faceRel.clear();
+            for (auto q = skipSpace(line + 2, lineEnd); q < lineEnd; q = skipSpace(q, lineEnd)) {
+                int v, vt = 0, vn = 0;
+                q = parseInt(q, lineEnd, v);
+                if (q < lineEnd && *q == '/') {
+                    ++q;
+                    if (q < lineEnd && *q != '/') {
+                        q = parseInt(q, lineEnd, vt);
+                    }
+                    if (q < lineEnd && *q == '/') {
+                        q = parseInt(q + 1, lineEnd, vn);
+                    }
+                }
+                // Skip anything unparsable up to the next corner
+                while (q < lineEnd && !isSpace(*q)) {
+                    ++q;
+                }
+
+                uint8_t rel = 0;
+                ObjCorner corner;
+                corner.v = fixIndex(v, c.v.size(), 1, rel, c.bad);
+                corner.vt = vt == 0 ? -1 : fixIndex(vt, c.vt.size(), 2, rel, c.bad);
+                corner.vn = vn == 0 ? -1 : fixIndex(vn, c.vn.size(), 4, rel, c.bad);
+                face.emplace_back(corner);
+                faceRel.emplace_back(rel);
+            }
+
+            // Fan around the first corner
+            for (size_t k = 2; k < face.size(); ++k) {
+                size_t tri[3] = {0, k - 1, k};
+                for (auto i : tri) {
+                    if (faceRel[i]) {
+                        c.relative.emplace_back(c.corners.size(), faceRel[i]);
+                    }
+                    c.corners.emplace_back(face[i]);
+                }
+            }
+        } else if (keyword(line, lineEnd, "g") || keyword(line, lineEnd, "o")) {
+            c.events.push_back({OBJ_GROUP, c.corners.size()/3, string()});
+        } else if (keyword(line, lineEnd, "usemtl")) {
+            auto q = skipSpace(line + 7, lineEnd);
+            auto e = q;
+            while (e < lineEnd && !isSpace(*e)) {
+                ++e;
+            }
+            c.events.push_back({OBJ_USEMTL, c.corners.size()/3, string(q, e)});
+        } else if (keyword(line, lineEnd, "mtllib")) {
+            auto q = skipSpace(line + 7, lineEnd);
+            c.events.push_back({OBJ_MTLLIB, c.corners.size()/3, string(q, lineEnd)});
+        }
+    }
+}
+
+// Load the first of the (space separated) mtl files in names that can be
+static void loadMtl(
+    const string &names, const string &base,
+    vector<tinyobj::material_t> &materials, map<string, int> &materialMap)
+{
+    tinyobj::MaterialFileReader reader(base);
+    size_t b = 0;
+    while (b < names.size()) {
+        auto e = names.find(' ', b);
+        e = e == string::npos ? names.size() : e;
+        string err;
+        if (e > b && reader(names.substr(b, e - b), &materials, &materialMap, &err)) {
+            return;
+        }
+        b = e + 1;
+    }
+    cerr << "Warning readObjFile: failed to load material file(s) " << names << ", using default material" << endl;
+}
+
+bool readObjFile(
+    const string &path,
+    const string &base,
+    const Transform &xform,
+    uint threads,
+    vector<MeshPtr> &meshes,
+    vector<MeshFileMaterial> &mtls)
+{
+    auto file = MappedFile::open(path);
+    if (file == nullptr) {
+        cerr << "Error readObjFile: cannot open " << path << endl;
+        return false;
+    }
+    auto data = reinterpret_cast<const char *>(file->data());
+    size_t size = file->size();
+
+    // Parse chunks of whole lines in parallel
+    uint n = size >= OBJFILE_PARALLEL_MIN ? max(threads, 1u) : 1;
+    vector<size_t> cuts(n + 1, size);
+    cuts[0] = 0;
+    for (uint i = 1; i < n; ++i) {
+        size_t at = max(cuts[i - 1], size/n*i);
+        auto eol = static_cast<const char *>(memchr(data + at, '\n', size - at));
+        cuts[i] = eol == nullptr ? size : eol - data + 1;
+    }
+    vector<ObjChunk> chunks(n);
+    ThreadPool::global().parallelFor(n, [&](uint i) {
+        parseChunk(data + cuts[i], data + cuts[i + 1], chunks[i]);
+    });
+
+    // Each chunk's elements go after those of the chunks before it
+    vector<size_t> vBegin(n + 1, 0), vtBegin(n + 1, 0), vnBegin(n + 1, 0), cBegin(n + 1, 0);
+    for (uint i = 0; i < n; ++i) {
+        vBegin[i + 1] = vBegin[i] + chunks[i].v.size();
+        vtBegin[i + 1] = vtBegin[i] + chunks[i].vt.size();
+        vnBegin[i + 1] = vnBegin[i] + chunks[i].vn.size();
+        cBegin[i + 1] = cBegin[i] + chunks[i].corners.size();
+    }
+    size_t numV = vBegin[n], numVt = vtBegin[n], numVn = vnBegin[n], numTris = cBegin[n]/3;
+    vector<glm::vec3> pos(numV), vn(numVn);
+    vector<glm::vec2> vt(numVt);
+    vector<ObjCorner> corners(3*numTris);
+    ThreadPool::global().parallelFor(n, [&](uint i) {
+        auto &c = chunks[i];
+        copy(c.v.begin(), c.v.end(), pos.begin() + vBegin[i]);
+        copy(c.vt.begin(), c.vt.end(), vt.begin() + vtBegin[i]);
+        copy(c.vn.begin(), c.vn.end(), vn.begin() + vnBegin[i]);
+        auto out = corners.begin() + cBegin[i];
+        copy(c.corners.begin(), c.corners.end(), out);
+        for (const auto &r : c.relative) {
+            auto &corner = out[r.first];
+            corner.v += r.second & 1 ? vBegin[i] : 0;
+            corner.vt += r.second & 2 ? vtBegin[i] : 0;
+            corner.vn += r.second & 4 ? vnBegin[i] : 0;
+        }
+        for (auto it = out; it != out + c.corners.size(); ++it) {
+            c.bad |= it->v < 0 || size_t(it->v) >= numV ||
+                it->vt < -1 || it->vt >= int(numVt) ||
+                it->vn < -1 || it->vn >= int(numVn);
+        }
+        // NB: Free each chunk as soon as it's merged to keep peak memory down
+        vector<glm::vec3>().swap(c.v);
+        vector<glm::vec3>().swap(c.vn);
+        vector<glm::vec2>().swap(c.vt);
+        vector<ObjCorner>().swap(c.corners);
+    });
+    for (const auto &c : chunks) {
+        if (c.bad) {
+            cerr << "Error readObjFile: face index out of range in " << path << endl;
+            return false;
+        }
+    }
+
+    // Statements in file order: shapes are split at groups, and triangles take the last used material
+    // NB: Like tinyobj, groups without faces don't make a shape, and the material carries over groups
+    vector<tinyobj::material_t> materials;
+    map<string, int> materialMap;
+    vector<pair<size_t, size_t>> shapes;
+    vector<pair<size_t, int>> mtlRuns(1, make_pair(size_t(0), -1));
+    size_t shapeBegin = 0;
+    for (uint i = 0; i < n; ++i) {
+        for (const auto &ev : chunks[i].events) {
+            size_t tri = cBegin[i]/3 + ev.tri;
+            if (ev.type == OBJ_GROUP) {
+                if (tri > shapeBegin) {
+                    shapes.emplace_back(shapeBegin, tri);
+                }
+                shapeBegin = tri;
+            } else if (ev.type == OBJ_USEMTL) {
+                auto it = materialMap.find(ev.arg);
+                int mid = it == materialMap.end() ? -1 : it->second;
+                if (mid != mtlRuns.back().second) {
+                    mtlRuns.emplace_back(tri, mid);
+                }
+            } else {
+                loadMtl(ev.arg, base, materials, materialMap);
+            }
+        }
+    }
+    if (numTris > shapeBegin) {
+        shapes.emplace_back(shapeBegin, numTris);
+    }
+
+    for (const auto &m : materials) {
+        mtls.push_back({
+            {m.diffuse[0], m.diffuse[1], m.diffuse[2]},
+            {m.specular[0], m.specular[1], m.specular[2]}
+        });
+    }
+
+    // Vertex normals by position: the sum of the face normals of the triangles without normals
+    // (each thread sums its own range of triangles), unless the file gives the vertex one
+    // NB: Left unnormalized since they're normalized after transforming anyway
+    uint tn = numTris >= OBJFILE_PARALLEL_MIN/64 ? n : 1;
+    vector<glm::vec3> norms(numV);
+    vector<vector<glm::vec3>> partial(tn - 1, vector<glm::vec3>(numV));
+    ThreadPool::global().parallelFor(tn, [&](uint i) {
+        auto &sum = i == 0 ? norms : partial[i - 1];
+        for (size_t t = numTris*i/tn; t < numTris*(i + 1)/tn; ++t) {
+            const auto *c = &corners[3*t];
+            if (c[0].vn != -1) {
+                continue;
+            }
+            // NB: Assumes winding order is correct, degenerate triangles add nothing
+            auto faceNorm = glm::cross(pos[c[1].v] - pos[c[0].v], pos[c[2].v] - pos[c[0].v]);
+            float len = glm::length(faceNorm);
+            if (len > 0) {
+                for (uint k = 0; k < 3; ++k) {
+                    sum[c[k].v] += faceNorm/len;
+                }
+            }
+        }
+    });
+    ThreadPool::global().parallelFor(tn, [&](uint i) {
+        for (size_t v = numV*i/tn; v < numV*(i + 1)/tn; ++v) {
+            for (const auto &sum : partial) {
+                norms[v] += sum[v];
+            }
+        }
+    });
+    partial.clear();
+    if (numVn > 0) {
+        for (const auto &c : corners) {
+            if (c.vn != -1) {
+                norms[c.v] = vn[c.vn];
+            }
+        }
+    }
+
+    // Build each shape's mesh (shapes in parallel) straight into its final arrays
+    // NB: Face corners sharing a position and texcoord share a mesh vertex, the first texcoord seen
+    // with each position is tracked in flat arrays, so only texture seams go through a hash map
+    glm::mat4 M = xform.matrix();
+    glm::mat3 N = glm::transpose(glm::inverse(glm::mat3(M)));
+    meshes.resize(shapes.size());
+    atomic<size_t> next(0);
+    ThreadPool::global().parallelFor(min<size_t>(n, shapes.size()), [&](uint) {
+        vector<uint32_t> stamp(numV, 0), first(numV);
+        vector<int> firstVt(numV);
+        vector<ObjCorner> verts;
+        unordered_map<uint64_t, uint32_t> seams;
+        for (size_t s = next++; s < shapes.size(); s = next++) {
+            size_t begin = shapes[s].first, count = shapes[s].second - begin;
+            aligned_vector<uint32_t, MESH_ALIGN> indices(3*count);
+            aligned_vector<uint16_t, MESH_ALIGN> matIds(count);
+            verts.clear();
+            seams.clear();
+            for (size_t i = 0; i < 3*count; ++i) {
+                const auto &c = corners[3*begin + i];
+                uint32_t id;
+                if (stamp[c.v] != s + 1) {
+                    stamp[c.v] = s + 1;
+                    first[c.v] = id = verts.size();
+                    firstVt[c.v] = c.vt;
+                    verts.emplace_back(c);
+                } else if (firstVt[c.v] == c.vt) {
+                    id = first[c.v];
+                } else {
+                    auto key = (uint64_t(uint32_t(c.v)) << 32) | uint32_t(c.vt + 1);
+                    auto it = seams.find(key);
+                    if (it == seams.end()) {
+                        it = seams.emplace(key, verts.size()).first;
+                        verts.emplace_back(c);
+                    }
+                    id = it->second;
+                }
+                indices[i] = id;
+            }
+
+            // Material runs overlapping the shape
+            auto run = upper_bound(mtlRuns.begin(), mtlRuns.end(), make_pair(begin, INT_MAX)) - 1;
+            for (size_t t = 0; t < count; ++t) {
+                while (run + 1 != mtlRuns.end() && (run + 1)->first <= begin + t) {
+                    ++run;
+                }
+                int mid = run->second;
+                matIds[t] = mid < 0 || mid >= static_cast<int>(mtls.size()) ? mtls.size() : mid;
+            }
+
+            aligned_vector<glm::vec3, MESH_ALIGN> positions(verts.size()), normals(verts.size());
+            aligned_vector<glm::vec2, MESH_ALIGN> uvs(verts.size());
+            for (size_t i = 0; i < verts.size(); ++i) {
+                const auto &c = verts[i];
+                positions[i] = glm::vec3(M*glm::vec4(pos[c.v], 1.0f));
+                normals[i] = glm::normalize(N*norms[c.v]);
+                uvs[i] = c.vt == -1 ? glm::vec2() : vt[c.vt];
+            }
+
+            auto mesh = make_shared<Mesh>();
+            mesh->positions.assign(move(positions));
+            mesh->normals.assign(move(normals));
+            mesh->uvs.assign(move(uvs));
+            mesh->indices.assign(move(indices));
+            mesh->matIds.assign(move(matIds));
+            meshes[s] = mesh;
+        }
+    });
+    return true;
+}
@@ -0,0 +1,21 @@
+#ifndef OBJFILE_H
+#define OBJFILE_H
+
+#include "mesh.hpp"
+#include "meshfile.hpp"
+
+#include <string>
+#include <vector>
+
+class Transform;
+
+// Obj files smaller than this are parsed on one thread
+#define OBJFILE_PARALLEL_MIN (1 << 20)
+
+// Load the geometry of each shape ('o' or 'g' group) of an obj file as a mesh transformed by xform,
+// and the materials of its mtl files (from base), using up to threads threads
+// NB: Polygons are split into fans, and vertices without normals get the average of their faces'
+bool readObjFile(
+    const std::string &path, const std::string &base, const Transform &xform, uint threads,
+    std::vector<MeshPtr> &meshes, std::vector<MeshFileMaterial> &mtls);
+#endif
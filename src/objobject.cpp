@@ -1,154 +1,219 @@
-#define TINYOBJLOADER_IMPLEMENTATION
-#include "tiny_obj_loader.h"
 #include "objobject.hpp"
 #include "material.hpp"
 #include "transform.hpp"
 #include "texture.hpp"
+#include "hash.hpp"
+#include "meshfile.hpp"
+#include "objfile.hpp"
+#include "assets.hpp"
+#include "threadpool.hpp"
 
 #include <glm/ext.hpp>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <map>
+#include <set>
+#include <tuple>
+#include <cstdio>
+#include <sys/stat.h>
 
 using namespace std;
 
 
-map<int, glm::vec3> getOrCreateNormals(
-    const vector<tinyobj::shape_t> &shapes,
-    const tinyobj::attrib_t &attrib);
-
-
-// NB: Maps vertex index (from obj file) to normals (either created or loaded)
-map<int, glm::vec3> getOrCreateNormals(
-    const vector<tinyobj::shape_t> &shapes,
-    const tinyobj::attrib_t &attrib)
+bool ObjObject::loadMeshes(
+    const string &file,
+    const string &base,
+    const Transform &xform,
+    uint threads,
+    vector<MeshPtr> &meshes,
+    vector<MeshFileMaterial> &mtls)
 {
-    map<int, glm::vec3> mpVertNorm; // Map vertex id to normal (1 to 1)
-    map<int, int> mpVertCount;      // Number of faces vertex belongs in
-    for (size_t s = 0; s < shapes.size(); ++s) {
-        for (size_t i = 0; i < shapes[s].mesh.indices.size()/3; ++i) {
-            if (shapes[s].mesh.indices[3*i].normal_index == -1) {
-                // Generate (not encoded in obj file)
-                vector<glm::vec3> v(3);
-                for (uint k = 0; k < v.size(); ++k) {
-                    auto idx = shapes[s].mesh.indices[3*i + k];
-                    auto vidx = idx.vertex_index;
-                    v[k] = glm::vec3(
-                        attrib.vertices[3*vidx],
-                        attrib.vertices[3*vidx+1],
-                        attrib.vertices[3*vidx+2]
-                    );
-                }
-                // NB: Assumes winding order is correct
-                auto faceNorm = glm::normalize(glm::cross(v[1]-v[0], v[2]-v[0]));
-                for (uint k = 0; k < v.size(); ++k) {
-                    auto idx = shapes[s].mesh.indices[3*i + k];
-                    auto vidx = idx.vertex_index;
-                    mpVertNorm[vidx] += faceNorm;
-                    mpVertCount[vidx]++;
-                }
-            } else {
-                // Load and normalize (not guarenteed to be normalized in standard)
-                for (uint k = 0; k < 3; ++k) {
-                    auto idx = shapes[s].mesh.indices[3*i + k];
-                    auto vidx = idx.vertex_index;
-                    auto nidx = idx.normal_index;
-                    mpVertNorm[vidx] = glm::normalize((glm::vec3(
-                        attrib.normals[3*nidx],
-                        attrib.normals[3*nidx+1],
-                        attrib.normals[3*nidx+2]
-                    )));
-                }
-            }
-        }
+    auto ext = string(MESHFILE_EXT);
+    if (file.size() >= ext.size() && file.compare(file.size() - ext.size(), ext.size(), ext) == 0) {
+        return readMeshFile(file, xform, meshes, mtls);
     }
 
-    // Divide to get the average for each generated normal
-    for (const auto &pr : mpVertCount) {
-        mpVertNorm[pr.first] /= pr.second;
-    }
-    cout << "Normals: " << mpVertNorm.size() << endl;
-    return mpVertNorm;
+    return readObjFile(file, base, xform, threads, meshes, mtls);
 }
 
 vector<shared_ptr<ObjObject>> ObjObject::loadFromFile(
     string file,
     string base,
     const Transform &xform,
-    const MaterialPtr &def)
+    const MaterialPtr &def,
+    const BvhConfig &cfg)
 {
     vector<shared_ptr<ObjObject>> objs;
-    vector<tinyobj::shape_t> shapes;
-    vector<tinyobj::material_t> materials;
-    tinyobj::attrib_t attrib;
-    string err;
+    auto model = Assets::model(file, base, xform, cfg.threads);
+    if (model == nullptr) {
+        return objs;
+    }
 
-    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, file.c_str(), base.c_str())) {
-        cerr << "Error loadFromFile: " << err << endl;
+    // Objects already made from this model with the same default material and build settings are
+    // shared (with their Bvhs), eg. for a copy of a file under another name
+    // NB: Like the Assets maps, entries whose objects are gone are erased (any of them, as such an entry
+    // is made again from scratch), which also keeps a reused model or material address from matching
+    static mutex sharedLock;
+    static map<tuple<const ModelAsset *, const Material *, uint64_t, string>, vector<weak_ptr<ObjObject>>> shared;
+    lock_guard<mutex> lock(sharedLock);
+    for (auto it = shared.begin(); it != shared.end();) {
+        bool gone = it->second.empty() || any_of(it->second.begin(), it->second.end(),
+            [](const weak_ptr<ObjObject> &p) { return p.expired(); });
+        it = gone ? shared.erase(it) : next(it);
+    }
+    auto &prev = shared[make_tuple(model.get(), def.get(), cfg.hash(), cfg.cacheDir)];
+    for (const auto &p : prev) {
+        auto obj = p.lock();
+        if (obj == nullptr) {
+            objs.clear();
+            break;
+        }
+        objs.emplace_back(obj);
+    }
+    if (!objs.empty()) {
         return objs;
     }
 
     // TODO: Kludge constant km texture
-    auto km = make_shared<TextureConst>(glm::vec3(0.3, 0.3, 0.3));
-
-    // Map the tinyob::material into Material instances
-    vector<MaterialPtr> mats(materials.size(), nullptr);
-    for (size_t i = 0; i < materials.size(); ++i) {
-        glm::vec3 kd(materials[i].diffuse[0], materials[i].diffuse[1], materials[i].diffuse[2]);
-        glm::vec3 ks(materials[i].specular[0], materials[i].specular[1], materials[i].specular[2]);
+    auto km = Assets::constant(glm::vec3(0.3, 0.3, 0.3));
+
+    // Map the obj materials into Material instances
+    const auto &mtls = model->mtls;
+    vector<MaterialPtr> mats(mtls.size(), nullptr);
+    for (size_t i = 0; i < mtls.size(); ++i) {
+        glm::vec3 kd(mtls[i].kd[0], mtls[i].kd[1], mtls[i].kd[2]);
+        glm::vec3 ks(mtls[i].ks[0], mtls[i].ks[1], mtls[i].ks[2]);
         // TODO: Probably pass "mirror" and "p" config down from config (constant for now)
-        mats[i] = make_shared<Material>(
-            make_shared<TextureConst>(kd), make_shared<TextureConst>(ks), km, true, 100
-        );
+        mats[i] = Assets::material(Assets::constant(kd), Assets::constant(ks), km, true, 100);
     }
 
     // Add default material
     mats.emplace_back(def);
 
-    // TODO: No support for texture coordinate right now
-    auto normals = getOrCreateNormals(shapes, attrib); // Model space
-    for (size_t s = 0; s < shapes.size(); ++s) {
+    // NB: Each object gets its own view of the (shared) geometry to hold these materials
+    for (size_t s = 0; s < model->meshes.size(); ++s) {
         auto obj = make_shared<ObjObject>();
-        for (size_t i = 0; i < shapes[s].mesh.indices.size()/3; ++i) {
-            int mid = shapes[s].mesh.material_ids[i];
-            if (mid < 0 || mid >= static_cast<int>(mats.size())) {
-                // Use default material.
-                mid = mats.size() - 1;
-            }
+        obj->mesh = Mesh::share(shared_ptr<const Mesh>(model, model->meshes[s].get()));
+        obj->mesh->materials = mats;
+        obj->mesh->getBounds(obj->box);
+        obj->bvhCfg = cfg;
+
+        // Cached Bvhs are keyed by everything the mesh is made from (builder settings are added later)
+        obj->cacheKey = fnv1aValue(uint64_t(s), model->key);
+        objs.emplace_back(obj);
+    }
+    prev.assign(objs.begin(), objs.end());
+
+    return objs;
+}
+
+// Bvhs mapped from and saved to cache dirs (see buildBvhs)
+static atomic<size_t> bvhsCached(0), bvhsSaved(0);
+
+const Bvh *ObjObject::getBvh(uint threads) const {
+    auto b = ready.load(memory_order_acquire);
+    if (b != nullptr) {
+        return b;
+    }
+
+    // NB: The first thread here queues the build, it and the rest then run it (and its subtasks) by
+    // waiting on its group, see ThreadPool::wait
+    auto &pool = ThreadPool::global();
+    {
+        lock_guard<mutex> l(building);
+        if (!started) {
+            started = true;
+            pool.submit(build, [this, threads]() { buildBvh(threads); });
+        }
+    }
+    pool.wait(build);
+    return ready.load(memory_order_acquire);
+}
+
+void ObjObject::buildBvh(uint threads) const {
+    auto cfg = bvhCfg;
+    string path;
+    uint64_t key = 0;
+    if (!cfg.cacheDir.empty()) {
+        key = fnv1aValue(cfg.hash(), cacheKey);
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(key));
+        path = cfg.cacheDir + "/" + name;
+        bvh = Bvh::load(path, key, mesh);
+        if (bvh != nullptr) {
+            bvhsCached++;
+        }
+    }
 
-            // Always normalize normals here since obj standard doesnt normalize
-            vector<Vertex> verts;
-            for (uint k = 0; k < 3; ++k) {
-                auto idx = shapes[s].mesh.indices[3*i + k];
-                auto vidx = idx.vertex_index;
-                auto tidx = idx.texcoord_index;
-                auto pos = xform.pos(glm::vec3(
-                    attrib.vertices[3*vidx],
-                    attrib.vertices[3*vidx+1],
-                    attrib.vertices[3*vidx+2]
-                ));
-                verts.emplace_back(
-                    pos,
-                    glm::normalize(xform.norm(normals[vidx])),
-                    tidx == -1 ? glm::vec2() : glm::vec2(
-                        attrib.texcoords[2*tidx],
-                        attrib.texcoords[2*tidx+1]
-                    )
-                );
-
-                // Update the AABB
-                obj->box.update(pos);
+    if (bvh == nullptr) {
+        cfg.threads = threads;
+        bvh = make_shared<Bvh>(mesh, cfg);
+        if (!path.empty()) {
+            // NB: The cache dir is created on first use (mkdir fails harmlessly if it exists)
+            mkdir(cfg.cacheDir.c_str(), 0755);
+            if (bvh->save(path, key)) {
+                bvhsSaved++;
+            } else {
+                cerr << "Error saving BVH cache: " << path << endl;
             }
-            obj->triangles.emplace_back(make_shared<Triangle>(verts[0], verts[1], verts[2], mats[mid]));
         }
+    }
+    ready.store(bvh.get(), memory_order_release);
+}
 
-        // TODO: This is a ghetto way of adding the bvh to the obj
-        obj->bvh = make_shared<Bvh>(obj->triangles);
-        objs.emplace_back(obj);
+void ObjObject::buildBvhs(const vector<shared_ptr<ObjObject>> &all, uint threads) {
+    // NB: Objects can be shared by several loads (see loadFromFile), each is only built once
+    vector<shared_ptr<ObjObject>> objs;
+    set<const ObjObject *> seen;
+    for (const auto &obj : all) {
+        if (!obj->bvhCfg.lazy && obj->ready == nullptr && seen.insert(obj.get()).second) {
+            objs.emplace_back(obj);
+        }
     }
 
-    return objs;
+    vector<size_t> order(objs.size());
+    size_t total = 0;
+    for (size_t i = 0; i < objs.size(); ++i) {
+        order[i] = i;
+        total += objs[i]->mesh->numTriangles();
+    }
+    sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return objs[a]->mesh->numTriangles() > objs[b]->mesh->numTriangles();
+    });
+
+    // Each worker takes the next largest object, giving it its share of the threads
+    size_t cached = bvhsCached, saved = bvhsSaved;
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next++; i < order.size(); i = next++) {
+            auto &obj = objs[order[i]];
+            obj->getBvh(max<size_t>(1, threads*obj->mesh->numTriangles()/max<size_t>(total, 1)));
+        }
+    };
+
+    ThreadPool::global().parallelFor(min<size_t>(threads, objs.size()), [&](uint) {
+        work();
+    });
+    cached = bvhsCached - cached;
+    saved = bvhsSaved - saved;
+    if (cached + saved > 0) {
+        cout << "BVH cache: " << cached << " loaded, " << saved << " saved" << endl;
+    }
 }
 
+bool ObjObject::enters(const glm::vec3 &eye, const glm::vec3 &dir, const std::pair<float, float> &rng) const {
+    float enter = rng.first, exit = rng.second;
+    const pair<float, float> *slabs[3] = {&box.x, &box.y, &box.z};
+    for (uint k = 0; k < 3; ++k) {
+        float inv = 1.0f/dir[k];
+        float t0 = (slabs[k]->first - eye[k])*inv, t1 = (slabs[k]->second - eye[k])*inv;
+        enter = max(enter, min(t0, t1));
+        exit = min(exit, max(t0, t1));
+    }
+    return enter <= exit;
+}
 
 bool ObjObject::intersect(
     const glm::vec3 &eye,
@@ -156,21 +221,24 @@ bool ObjObject::intersect(
     HitRecord &minHr,
     const std::pair<float, float> &rng) const
 {
-    // Use linear search if no bvh for obj
-    if (bvh != nullptr) {
-        return bvh->intersect(eye, dir, minHr, rng);
-    } else {
-        auto tx = calcT(eye.x, dir.x, box.x);
-        auto ty = calcT(eye.y, dir.y, box.y);
-        auto tz = calcT(eye.z, dir.z, box.z);
-        if (tx.first > ty.second || tx.first > tz.second) return false;
-        if (ty.first > tx.second || ty.first > tz.second) return false;
-        if (tz.first > ty.second || tz.first > tx.second) return false;
-
-        for (const auto &triangle : triangles) {
-            triangle->intersect(eye, dir, minHr, rng);
+    auto b = ready.load(memory_order_acquire);
+    if (b == nullptr) {
+        // Not built until a ray reaches the box (which the Bvh tests itself from then on)
+        if (!enters(eye, dir, make_pair(rng.first, min(rng.second, minHr.t)))) {
+            return minHr.surf != nullptr;
         }
+        b = getBvh(bvhCfg.threads);
     }
+    return b->intersect(eye, dir, minHr, rng);
+}
 
-    return minHr.surf != nullptr;
+bool ObjObject::occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const {
+    auto b = ready.load(memory_order_acquire);
+    if (b == nullptr) {
+        if (!enters(eye, dir, make_pair(0.0f, tmax))) {
+            return false;
+        }
+        b = getBvh(bvhCfg.threads);
+    }
+    return b->occluded(eye, dir, tmax);
 }
@@ -1,12 +1,16 @@
 #ifndef OBJOBJECT_H
 #define OBJOBJECT_H
 
-#include "triangle.hpp"
+#include "mesh.hpp"
 #include "aabb.hpp"
 #include "bvh.hpp"
+#include "meshfile.hpp"
+#include "threadpool.hpp"
 
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <atomic>
 
 using namespace std;
 
@@ -14,23 +18,61 @@ class Transform;
 
 class ObjObject : public Object {
 public:
-    ObjObject() { }
+    ObjObject() : cacheKey(0), started(false), build(nullptr), ready(nullptr) { }
     virtual ~ObjObject() { }
     bool intersect(
         const glm::vec3 &eye,
         const glm::vec3 &dir,
         HitRecord &hr,
         const std::pair<float, float> &rng) const;
+    bool occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const;
+    bool getBounds(AABB &box) const { box.update(this->box); return true; }
 
-    // Load each shape in obj file as a ObjObject
+    // Load the geometry of each shape (transformed by xform) and the material table of an obj file
+    // (parsed on up to threads threads), or of a binary mesh file (MESHFILE_EXT, see objconv)
+    static bool loadMeshes(
+        const string &file, const string &base, const Transform &xform, uint threads,
+        vector<MeshPtr> &meshes, vector<MeshFileMaterial> &mtls);
+
+    // Load each shape in obj (or mesh) file as a ObjObject, sharing the geometry of any earlier load of
+    // the same file (see Assets::model)
+    // NB: Bvhs are not built here (see buildBvhs), cfg is kept for when they are
     static vector<shared_ptr<ObjObject>> loadFromFile(
-        string file, string base, const Transform &transform, const MaterialPtr &def);
+        string file, string base, const Transform &transform, const MaterialPtr &def,
+        const BvhConfig &cfg = BvhConfig());
+
+    // Build the Bvh of each (not lazy) object, objects are built concurrently (largest first) on up to
+    // threads threads, and large objects are given several threads to build subtrees with
+    // NB: With a cache dir set, Bvhs are mapped from (or saved to) it instead, see Bvh::load
+    static void buildBvhs(const vector<shared_ptr<ObjObject>> &objs, uint threads);
+private:
+    // The Bvh, built (once, queued by whichever thread gets here first) with up to threads threads
+    const Bvh *getBvh(uint threads) const;
+
+    // Map the Bvh from the cache dir or build it (see getBvh)
+    void buildBvh(uint threads) const;
+
+    // Ray enters box within rng
+    bool enters(const glm::vec3 &eye, const glm::vec3 &dir, const std::pair<float, float> &rng) const;
 private:
-    vector<shared_ptr<Triangle>> triangles;
+    MeshPtr mesh;
     AABB box;
+    BvhConfig bvhCfg;
+
+    // Hash of the obj file bytes, transform and shape index
+    uint64_t cacheKey;
 
-    // This is to allow lazy loading... don't judge :P
-    shared_ptr<Bvh> bvh;
+    // Built on demand (see BvhConfig::lazy) so meshes no ray reaches never are, until then only the
+    // bounds are used
+    // NB: Render threads reaching the mesh meanwhile wait on build, so they run the build's subtasks
+    // rather than sitting idle
+    // NB: build outlives the task that queues it, so it is not nested in that task's group
+    // NB: ready is set once bvh is, so traversal only pays for an atomic load
+    mutable mutex building;
+    mutable bool started;
+    mutable ThreadPool::Group build;
+    mutable shared_ptr<Bvh> bvh;
+    mutable atomic<const Bvh *> ready;
 };
 
 #endif
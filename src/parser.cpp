@@ -1,6 +1,7 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <algorithm>
 
 #include "rapidjson/document.h"
 
@@ -12,6 +13,11 @@
 #include "surface.hpp"
 #include "objobject.hpp"
 #include "transform.hpp"
+#include "instance.hpp"
+#include "assets.hpp"
+#include "threadpool.hpp"
+
+#include <glm/ext.hpp>
 
 using namespace std;
 
@@ -24,23 +30,60 @@ pair<int, int> parseImageDim(const rapidjson::Document &doc) {
 // Initialize raytracer camera using json config
 RayTracer parseSceneCamera(const rapidjson::Document &doc, uint num_threads) {
     const auto &cam = doc["scene"]["camera"];
-    return RayTracer(num_threads,
+    RayTracer rt(num_threads,
         glm::vec3(cam["eye"][0].GetFloat(), cam["eye"][1].GetFloat(), cam["eye"][2].GetFloat()),
         glm::vec3(cam["look_at"][0].GetFloat(), cam["look_at"][1].GetFloat(), cam["look_at"][2].GetFloat()),
         glm::vec3(cam["up"][0].GetFloat(), cam["up"][1].GetFloat(), cam["up"][2].GetFloat()),
         cam["fovy"].GetInt());
+    if (doc["scene"].HasMember("tile_size")) {
+        rt.setTileSize(doc["scene"]["tile_size"].GetUint());
+    }
+    if (doc["scene"].HasMember("tile_order") && !rt.setTileOrder(doc["scene"]["tile_order"].GetString())) {
+        cerr << "Unknown tile order: " << doc["scene"]["tile_order"].GetString() << endl;
+    }
+    if (doc["scene"].HasMember("tile_cost") && !rt.setTileCost(doc["scene"]["tile_cost"].GetString())) {
+        cerr << "Unknown tile cost: " << doc["scene"]["tile_cost"].GetString() << endl;
+    }
+    return rt;
+}
+
+SampleConfig parseSampleConfig(const rapidjson::Document &doc) {
+    SampleConfig cfg;
+    if (!doc.HasMember("sampling") || !doc["sampling"].IsObject()) {
+        return cfg;
+    }
+
+    const auto &val = doc["sampling"];
+    if (val.HasMember("mode") && !cfg.setMode(val["mode"].GetString())) {
+        cerr << "Unknown sampling mode: " << val["mode"].GetString() << endl;
+    }
+    if (val.HasMember("min_samples")) {
+        cfg.minSamples = val["min_samples"].GetUint();
+    }
+    if (val.HasMember("max_samples")) {
+        cfg.maxSamples = val["max_samples"].GetUint();
+    }
+    if (val.HasMember("threshold")) {
+        cfg.threshold = val["threshold"].GetFloat();
+    }
+    if (val.HasMember("converged")) {
+        cfg.converged = val["converged"].GetFloat();
+    }
+    if (val.HasMember("adaptive_shadows")) {
+        cfg.adaptiveShadows = val["adaptive_shadows"].GetBool();
+    }
+    if (val.HasMember("decoupled")) {
+        cfg.decoupled = val["decoupled"].GetBool();
+    }
+    return cfg;
 }
 
 // Parse texture image or const
 TexturePtr parseTexture(const rapidjson::Value &val) {
     if (val.IsString()) {
-        auto img = make_shared<Image>();
-        img->loadPng(val.GetString());
-        return make_shared<TextureImage>(img);
+        return Assets::image(val.GetString());
     } else if (val.IsArray()) {
-        return make_shared<TextureConst>(
-            glm::vec3(val[0].GetFloat(), val[1].GetFloat(), val[2].GetFloat())
-        );
+        return Assets::constant(glm::vec3(val[0].GetFloat(), val[1].GetFloat(), val[2].GetFloat()));
     }
 
     return nullptr;
@@ -50,14 +93,30 @@ TexturePtr parseTexture(const rapidjson::Value &val) {
 map<string, MaterialPtr> parseMaterials(const rapidjson::Document &doc) {
     map<string, MaterialPtr> mp;
     // TODO: Support configurable Km
-    auto km = make_shared<TextureConst>(glm::vec3(0.3, 0.3, 0.3));
+    auto km = Assets::constant(glm::vec3(0.3, 0.3, 0.3));
 
     if (doc.HasMember("materials") && doc["materials"].IsArray()) {
+        // Decode every image texture up front on the thread pool (held here so the registry keeps them)
+        vector<string> paths;
+        for (const auto &mtl : doc["materials"].GetArray()) {
+            for (auto key : {"kd", "ks"}) {
+                if (mtl[key].IsString()) {
+                    paths.emplace_back(mtl[key].GetString());
+                }
+            }
+        }
+        sort(paths.begin(), paths.end());
+        paths.erase(unique(paths.begin(), paths.end()), paths.end());
+        vector<TexturePtr> images(paths.size());
+        ThreadPool::global().parallelFor(paths.size(), [&](uint i) {
+            images[i] = Assets::image(paths[i]);
+        });
+
         for (const auto &mtl : doc["materials"].GetArray()) {
             // TODO: Support texture from images
             auto kd = parseTexture(mtl["kd"]);
             auto ks = parseTexture(mtl["ks"]);
-            mp[mtl["name"].GetString()] = make_shared<Material>(
+            mp[mtl["name"].GetString()] = Assets::material(
                 kd, ks, km, mtl["mirror"].GetBool(), mtl["p"].GetFloat()
             );
         }
@@ -95,13 +154,84 @@ shared_ptr<Transform> parseTransform(const rapidjson::Value &xform) {
     return nullptr;
 }
 
+bool parseInstance(const rapidjson::Value &val, glm::mat4 &xform) {
+    if (!val.IsArray()) {
+        return false;
+    }
+    auto n = val.Size();
+    xform = glm::mat4(1.0f);
+    if (n == 12) {
+        // NB: glm is column major
+        for (uint r = 0; r < 3; ++r) {
+            for (uint c = 0; c < 4; ++c) {
+                xform[c][r] = val[4*r + c].GetFloat();
+            }
+        }
+        return true;
+    }
+    if (n < 3 || n > 5) {
+        return false;
+    }
+    xform = glm::translate(xform, glm::vec3(val[0].GetFloat(), val[1].GetFloat(), val[2].GetFloat()));
+    if (n == 5) {
+        xform = glm::rotate(xform, glm::radians(val[4].GetFloat()), glm::vec3(0, 1, 0));
+    }
+    if (n >= 4) {
+        xform = glm::scale(xform, glm::vec3(val[3].GetFloat()));
+    }
+    return true;
+}
+
+// Read in bvh build parameters (defaults for anything missing)
+BvhConfig parseBvhConfig(const rapidjson::Document &doc) {
+    if (!doc.HasMember("bvh") || !doc["bvh"].IsObject()) {
+        return BvhConfig();
+    }
+    return parseBvhConfig(doc["bvh"], BvhConfig());
+}
+
+// Override parameters of cfg set in bvh
+BvhConfig parseBvhConfig(const rapidjson::Value &bvh, BvhConfig cfg) {
+    if (bvh.HasMember("split") && !cfg.setSplit(bvh["split"].GetString())) {
+        cerr << "Unknown BVH split: " << bvh["split"].GetString() << endl;
+    }
+    if (bvh.HasMember("bins")) {
+        cfg.bins = bvh["bins"].GetUint();
+    }
+    if (bvh.HasMember("traversal_cost")) {
+        cfg.traversalCost = bvh["traversal_cost"].GetFloat();
+    }
+    if (bvh.HasMember("leaf_cost")) {
+        cfg.leafCost = bvh["leaf_cost"].GetFloat();
+    }
+    if (bvh.HasMember("max_leaf_size") && !cfg.setMaxLeafSize(bvh["max_leaf_size"].GetUint())) {
+        cerr << "Unsupported BVH max leaf size: " << bvh["max_leaf_size"].GetUint() << endl;
+    }
+    if (bvh.HasMember("width") && !cfg.setWidth(bvh["width"].GetUint())) {
+        cerr << "Unsupported BVH width: " << bvh["width"].GetUint() << endl;
+    }
+    if (bvh.HasMember("cache")) {
+        cfg.cacheDir = bvh["cache"].GetString();
+    }
+    if (bvh.HasMember("lazy")) {
+        cfg.lazy = bvh["lazy"].GetBool();
+    }
+    if (bvh.HasMember("max_duplication")) {
+        cfg.maxDuplication = bvh["max_duplication"].GetFloat();
+    }
+    if (bvh.HasMember("morton_bits") && !cfg.setMortonBits(bvh["morton_bits"].GetUint())) {
+        cerr << "Unsupported Morton code length: " << bvh["morton_bits"].GetUint() << endl;
+    }
+    return cfg;
+}
+
 // Read in objects from config
-vector<shared_ptr<Object>> parseScene(const rapidjson::Document &doc, map<string, MaterialPtr> &mtl) {
+vector<shared_ptr<Object>> parseScene(
+    const rapidjson::Document &doc, map<string, MaterialPtr> &mtl, const BvhConfig &bvhCfg) {
     vector<shared_ptr<Object>> v;
+    vector<shared_ptr<ObjObject>> meshObjs;
 
     // First parse and load models
-    // NB: No instancing support and no caching obj files in memory, ie if two teapots are loaded
-    // both need to be read from file... for now
     map<string ,string> name_to_file;
     map<string, string> name_to_dir;
     if (doc.HasMember("models") && doc["models"].IsArray()) {
@@ -112,12 +242,33 @@ vector<shared_ptr<Object>> parseScene(const rapidjson::Document &doc, map<string
     }
 
     // Parse scene models
-    auto defMaterial = make_shared<Material>(
-        make_shared<TextureConst>(glm::vec3(0.7, 0.7, 0.7)),
-        make_shared<TextureConst>(glm::vec3(0.3, 0.3, 0.3)),
-        make_shared<TextureConst>(glm::vec3(0.3, 0.3, 0.3)),
+    auto defMaterial = Assets::material(
+        Assets::constant(glm::vec3(0.7, 0.7, 0.7)),
+        Assets::constant(glm::vec3(0.3, 0.3, 0.3)),
+        Assets::constant(glm::vec3(0.3, 0.3, 0.3)),
         true,
         100);
+
+    // Refs of the same model (with the same material and build parameters) share one copy of it,
+    // models referenced once (without "instances") are still baked into world space
+    // NB: Shared models are loaded in model space and placed by an Instance per ref or instance
+    struct SharedModel {
+        SharedModel() : refs(0) { }
+        uint refs;
+        shared_ptr<Object> model;
+    };
+    map<string, SharedModel> shared;
+    auto modelKey = [&](const rapidjson::Value &m, const BvhConfig &cfg) {
+        return string(m["name"].GetString()) + "/" +
+            (m.HasMember("material") ? m["material"].GetString() : "") + "/" + to_string(cfg.hash());
+    };
+    for (const auto &m : doc["scene"]["models"].GetArray()) {
+        if (string(m["type"].GetString()) == "ref") {
+            auto refCfg = m.HasMember("bvh") && m["bvh"].IsObject() ? parseBvhConfig(m["bvh"], bvhCfg) : bvhCfg;
+            shared[modelKey(m, refCfg)].refs += m.HasMember("instances") ? 2 : 1;
+        }
+    }
+
     for (const auto &m : doc["scene"]["models"].GetArray()) {
         string type = m["type"].GetString();
         if (type == "sphere") {
@@ -139,22 +290,65 @@ vector<shared_ptr<Object>> parseScene(const rapidjson::Document &doc, map<string
         } else if (type == "ref") {
             // Parse transforms
             vector<shared_ptr<Transform>> xforms;
-            for (const auto &xform : m["transforms"].GetArray()) {
-                auto t = parseTransform(xform);
-                if (t) {
-                    xforms.emplace_back(t);
+            if (m.HasMember("transforms")) {
+                for (const auto &xform : m["transforms"].GetArray()) {
+                    auto t = parseTransform(xform);
+                    if (t) {
+                        xforms.emplace_back(t);
+                    }
                 }
             }
 
             // Merge transforms into a transform chain and load object
             auto chain = TransformChain(xforms);
             auto modelDefaultMat = m.HasMember("material") ? mtl[m["material"].GetString()] : defMaterial;
+
+            // Each ref may override the build parameters (eg. a faster builder for a huge model)
+            auto refCfg = m.HasMember("bvh") && m["bvh"].IsObject() ? parseBvhConfig(m["bvh"], bvhCfg) : bvhCfg;
+            auto &model = shared[modelKey(m, refCfg)];
+            if (model.refs > 1) {
+                if (model.model == nullptr) {
+                    auto objs = ObjObject::loadFromFile(
+                        name_to_file[m["name"].GetString()],
+                        name_to_dir[m["name"].GetString()],
+                        Transform(),
+                        modelDefaultMat,
+                        refCfg
+                    );
+                    if (objs.empty()) {
+                        continue;
+                    }
+                    meshObjs.insert(meshObjs.end(), objs.begin(), objs.end());
+                    model.model = objs.size() == 1 ?
+                        shared_ptr<Object>(objs[0]) :
+                        make_shared<SceneBvh>(vector<shared_ptr<Object>>(objs.begin(), objs.end()), refCfg);
+                }
+
+                // Each instance is placed by the ref's transforms, then its own
+                auto base = chain.matrix();
+                if (!m.HasMember("instances")) {
+                    v.emplace_back(make_shared<Instance>(model.model, base));
+                    continue;
+                }
+                for (const auto &inst : m["instances"].GetArray()) {
+                    glm::mat4 xform;
+                    if (!parseInstance(inst, xform)) {
+                        cerr << "Invalid instance of " << m["name"].GetString() << endl;
+                        continue;
+                    }
+                    v.emplace_back(make_shared<Instance>(model.model, xform*base));
+                }
+                continue;
+            }
+
             auto objs = ObjObject::loadFromFile(
                 name_to_file[m["name"].GetString()],
                 name_to_dir[m["name"].GetString()],
                 chain,
-                modelDefaultMat
+                modelDefaultMat,
+                refCfg
             );
+            meshObjs.insert(meshObjs.end(), objs.begin(), objs.end());
             std::copy(
                 std::make_move_iterator(objs.begin()),
                 std::make_move_iterator(objs.end()),
@@ -164,6 +358,9 @@ vector<shared_ptr<Object>> parseScene(const rapidjson::Document &doc, map<string
             cerr << "Unknown Type: " << type << endl;
         }
     }
+
+    // Build every (eager) model's Bvh together so independent shapes keep all threads busy
+    ObjObject::buildBvhs(meshObjs, bvhCfg.threads);
     return v;
 }
 
@@ -3,6 +3,7 @@
 
 #include "raytracer.hpp"
 #include "transform.hpp"
+#include "bvh.hpp"
 #include "rapidjson/document.h"
 
 // Parse image dimensions
@@ -11,15 +12,29 @@ pair<int, int> parseImageDim(const rapidjson::Document &doc);
 // Initialize raytracer camera using json config
 RayTracer parseSceneCamera(const rapidjson::Document &doc, uint num_threads);
 
+// Read in primary ray sampling parameters from "sampling" (defaults for anything missing)
+SampleConfig parseSampleConfig(const rapidjson::Document &doc);
+
 // Read in generated materials from config
 map<string, MaterialPtr> parseMaterials(const rapidjson::Document &doc);
 
+// Read in bvh build parameters (defaults for anything missing)
+BvhConfig parseBvhConfig(const rapidjson::Document &doc);
+
+// Override parameters of cfg set in bvh (eg. per ref model)
+BvhConfig parseBvhConfig(const rapidjson::Value &bvh, BvhConfig cfg);
+
 // Read in objects from config
-vector<shared_ptr<Object>> parseScene(const rapidjson::Document &doc, map<string, MaterialPtr> &mtl);
+vector<shared_ptr<Object>> parseScene(
+    const rapidjson::Document &doc, map<string, MaterialPtr> &mtl, const BvhConfig &bvhCfg);
 
 // Read in lights from doc
 vector<shared_ptr<Light>> parseLights(const rapidjson::Document &doc);
 
 // Read in transform
 shared_ptr<Transform> parseTransform( const rapidjson::Value &val);
+
+// Read in the placement of one instance: [x, y, z], [x, y, z, scale], [x, y, z, scale, angle]
+// (degrees about y, applied after the scale) or a row major 3x4 affine matrix (12 numbers)
+bool parseInstance(const rapidjson::Value &val, glm::mat4 &xform);
 #endif
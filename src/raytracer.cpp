@@ -1,14 +1,13 @@
 #include "raytracer.hpp"
 #include "surface.hpp"
+#include "instance.hpp"
 
 #include <iostream>
 #include <glm/ext.hpp>
 #include <random>
 
 #include <thread>
-#include <mutex>
 #include <algorithm>
-#include <queue>
 #include <chrono>
 
 static const float EPS = 1e-3;
@@ -16,153 +15,440 @@ static const float SUBSAMPLES = 4;
 static const float SUBSAMPLE_DIV = 1.0f / SUBSAMPLES;
 static const float SHADOWSAMPLES = 16;
 
-// Per job specific data
-struct JobData {
-    queue<pair<uint, uint>> jobsQueue;
-    mutex queueMutex;
+// Adaptive shadows cast this many rays to a light first, and stop there if they all agree
+static const uint SHADOW_PROBES = 4;
+
+// Otherwise (a penumbra) they cast this many per steradian the light subtends, within
+// [SHADOWSAMPLES, SHADOW_MAX_SAMPLES]
+static const float SHADOW_SAMPLES_PER_SR = 400;
+static const uint SHADOW_MAX_SAMPLES = 64;
+
+// Primary samples per adaptive round, one in each cell of a 2x2 grid over the pixel
+static const uint ROUND_STRATA = 2;
+
+// Most primary samples traced for a pixel at once (the SUBSAMPLES x SUBSAMPLES grid)
+static const uint PIXEL_MAX_SAMPLES = 16;
+
+// Running sums of a pixel's primary samples (for adaptive sampling)
+// NB: A shading standing for several samples (see SampleConfig::decoupled) counts once per sample,
+// like the pixel value does, so a pixel wholly on one surface has no variance at all
+struct PixelSamples {
+    PixelSamples() : sum(0, 0, 0), lum(0), lumSq(0), n(0), done(false) { }
+
+    // Add a shading standing for weight primary samples
+    void add(const glm::vec3 &col, uint weight = 1) {
+        float y = glm::dot(col, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+        sum += col*float(weight);
+        lum += y*weight;
+        lumSq += y*y*weight;
+        n += weight;
+    }
+
+    // Standard error of the mean luminance of the samples
+    float error() const {
+        if (n < 2) {
+            return numeric_limits<float>::infinity();
+        }
+        float var = (lumSq - lum*lum/n)/(n - 1);
+        return glm::sqrt(max(var, 0.0f)/n);
+    }
+
+    glm::vec3 sum;
+    float lum, lumSq;
+    uint n;
+    bool done;
 };
 
+// Per render data, shared by that render's tasks
+struct RenderJob {
+    RenderJob(Image &img) : img(img) { }
+
+    Image &img;
+    glm::vec3 l;  // Lower left hand corner of the image plane
+    float impW;
+    vector<Tile> tiles;   // Of the current round
+    vector<float> times;  // Seconds spent tracing each tile this round
+    TileCosts costs;      // Seconds spent on each tile cell over all rounds
+    vector<unique_ptr<TileDeque>> deques;
+    atomic<uint> tilesLeft, tilesStolen, tasksLeft;
+    uint rounds;
+
+    // Running sums of each pixel, kept between rounds (SampleConfig::PROGRESSIVE only)
+    vector<PixelSamples> pixels;
+    atomic<size_t> unconverged;
+    atomic<uint64_t> samples;
+    chrono::steady_clock::time_point start;
+};
+
+bool SampleConfig::setMode(const string &name) {
+    if (name == "fixed") {
+        mode = FIXED;
+    } else if (name == "adaptive") {
+        mode = ADAPTIVE;
+    } else if (name == "progressive") {
+        mode = PROGRESSIVE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 void RayTracer::render(Image &img) {
+    auto &pool = ThreadPool::global();
+    ThreadPool::Group group;
+    submit(img, group);
+    cout << "Waiting for render tasks..." << endl;
+    pool.wait(group);
+}
+
+void RayTracer::submit(Image &img, ThreadPool::Group &group) {
+    if (scene == nullptr) {
+        scene = unique_ptr<SceneBvh>(new SceneBvh(objs, bvhCfg));
+        cout << "Scene: " << scene->numBounded() << " bounded, " << scene->numUnbounded() << " unbounded objects" << endl;
+    }
+
     // NB: 'c' is centre of image plane, 'l' is lower left hand corner
-    impW = impH * (float(img.width()) / float(img.height()));
+    auto job = make_shared<RenderJob>(img);
+    job->start = chrono::steady_clock::now();
+    job->impW = impH * (float(img.width()) / float(img.height()));
     auto c = eye - w*focalLength;
-    auto l = c - u*impW/2.0f - v*impH/2.0f;
-    auto chunkSize = (img.height() / numThreads) + (img.height() % numThreads != 0);
-    vector<thread> workers(numThreads);
-    vector<JobData> jobs(numThreads);
-    atomic<uint> jobsLeft(img.width() * img.height());
-    mutex lbMutex;
-    condition_variable lbCv;
-
-    for (uint chunk = 0; chunk < numThreads; ++chunk) {
-        for (uint j = chunk*chunkSize; j < min((chunk+1)*chunkSize, img.height()); ++j) {
-            for (uint i = 0; i < img.width(); ++i) {
-                jobs[chunk].jobsQueue.emplace(make_pair(i, j));
+    job->l = c - u*job->impW/2.0f - v*impH/2.0f;
+
+    job->costs.width = img.width();
+    job->costs.height = img.height();
+    job->costs.size = tileSize;
+    job->costs.cost.assign(((img.width() + tileSize - 1)/tileSize)*((img.height() + tileSize - 1)/tileSize), 0);
+    job->tilesStolen = 0;
+    job->rounds = 0;
+    job->samples = 0;
+    if (sampling.mode == SampleConfig::PROGRESSIVE) {
+        job->pixels.resize(size_t(img.width())*img.height());
+        job->unconverged = job->pixels.size();
+    }
+
+    job->tiles = makeTiles(img.width(), img.height(), tileSize, tileOrder);
+    vector<float> costs;
+    if (tileCost != COST_NONE) {
+        costs = estimateCosts(*job);
+        orderByCost(job->tiles, costs);
+    }
+    submitRound(job, costs, group);
+}
+
+void RayTracer::submitRound(shared_ptr<RenderJob> job, const vector<float> &costs, ThreadPool::Group &group) {
+    job->rounds++;
+    job->deques.resize(numThreads);
+    if (costs.empty()) {
+        // Each task starts with a contiguous band of tiles along the tile order, pushed in reverse so it
+        // pops them in order (each next to the last) and thieves take from the far end of the band
+        uint n = job->tiles.size();
+        auto chunkSize = (n / numThreads) + (n % numThreads != 0);
+        for (uint chunk = 0; chunk < numThreads; ++chunk) {
+            auto begin = min(chunk*chunkSize, n), end = min((chunk+1)*chunkSize, n);
+            job->deques[chunk] = unique_ptr<TileDeque>(new TileDeque(max(end - begin, 1u)));
+            for (auto t = end; t > begin; --t) {
+                job->deques[chunk]->push(t - 1);
+            }
+        }
+    } else {
+        // Deal the tiles (sorted by cost) out most expensive first, each to the task with the least work so
+        // far, then push them cheapest first so each task pops its most expensive first and thieves take
+        // the cheap ones
+        vector<vector<uint32_t>> dealt(numThreads);
+        vector<float> load(numThreads, 0);
+        for (uint32_t t = 0; t < job->tiles.size(); ++t) {
+            auto k = min_element(load.begin(), load.end()) - load.begin();
+            dealt[k].push_back(t);
+            load[k] += costs[t];
+        }
+        for (uint k = 0; k < numThreads; ++k) {
+            job->deques[k] = unique_ptr<TileDeque>(new TileDeque(max<size_t>(dealt[k].size(), 1)));
+            for (auto t = dealt[k].rbegin(); t != dealt[k].rend(); ++t) {
+                job->deques[k]->push(*t);
             }
         }
-
-        // NB: We can bind a reference to thread since thread lifetime < lifetime of this function
-        workers[chunk] = thread(
-            &RayTracer::traceRows, this, ref(l), ref(jobs[chunk]), ref(jobsLeft), ref(img), ref(lbCv)
-        );
     }
 
-    auto lbThread = thread(&RayTracer::loadBalance, this, ref(jobs), ref(jobsLeft), ref(lbMutex), ref(lbCv));
-    cout << "Waiting for threads to join..." << endl;
-    std::for_each(workers.begin(), workers.end(), [](thread& x){ x.join(); });
-    lbThread.join();
+    uint n = job->tiles.size();
+    job->times.assign(n, 0);
+    job->tilesLeft = n;
+    job->tasksLeft = numThreads;
+    for (uint id = 0; id < numThreads; ++id) {
+        // NB: The last task queues the next round (if any) before it finishes, so group stays busy
+        ThreadPool::global().submit(group, [this, job, id, &group]() {
+            traceTiles(*job, id);
+            if (job->tasksLeft.fetch_sub(1) == 1) {
+                finishRound(job, group);
+            }
+        });
+    }
 }
 
-void RayTracer::traceRows(const glm::vec3 &l, JobData &job, atomic<uint> &jobsLeft, Image &img, condition_variable &lbCv) const {
-    while (jobsLeft > 0) {
-        job.queueMutex.lock();
-        if (job.jobsQueue.empty()) {
-            lbCv.notify_one();
-            job.queueMutex.unlock();
+void RayTracer::finishRound(shared_ptr<RenderJob> job, ThreadPool::Group &group) {
+    for (size_t t = 0; t < job->tiles.size(); ++t) {
+        job->costs.cost[job->costs.cell(job->tiles[t])] += job->times[t];
+    }
 
-            // Sleep for half second to reduce busy waiting
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    auto pixels = size_t(job->img.width())*job->img.height();
+    if (sampling.mode == SampleConfig::PROGRESSIVE && job->unconverged > sampling.converged*pixels) {
+        // Another round over the tiles that still have unconverged pixels, ordered by this round's timings
+        vector<Tile> tiles;
+        vector<float> costs;
+        for (size_t t = 0; t < job->tiles.size(); ++t) {
+            const auto &tile = job->tiles[t];
+            bool active = false;
+            for (uint j = tile.y0; j < tile.y1 && !active; ++j) {
+                for (uint i = tile.x0; i < tile.x1 && !active; ++i) {
+                    active = !job->pixels[size_t(j)*job->img.width() + i].done;
+                }
+            }
+            if (active) {
+                tiles.push_back(tile);
+                costs.push_back(job->times[t]);
+            }
+        }
+
+        job->tiles.swap(tiles);
+        if (tileCost == COST_NONE) {
+            costs.clear();
         } else {
-            auto i = job.jobsQueue.front().first;
-            auto j = job.jobsQueue.front().second;
-            job.jobsQueue.pop();
-            job.queueMutex.unlock();
-            jobsLeft--;
-            tracePixel(l, img, i, j);
+            orderByCost(job->tiles, costs);
         }
+        submitRound(job, costs, group);
+        return;
+    }
+
+    // Keep the timings for the next render to schedule with
+    atomic_store(&lastCosts, shared_ptr<const TileCosts>(make_shared<TileCosts>(job->costs)));
+
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - job->start).count();
+    cout << "Tiles: " << job->costs.cost.size() << " of " << tileSize << "x" << tileSize << ", "
+         << job->tilesStolen << " stolen" << endl;
+    cout << "Samples: " << float(job->samples)/pixels << " per pixel";
+    if (sampling.mode == SampleConfig::PROGRESSIVE) {
+        cout << " over " << job->rounds << " rounds, " << job->unconverged << " pixels unconverged";
     }
-    cout << "Done job" << endl;
+    cout << endl;
+    cout << "Rendered " << pixels << " pixels in " << ms << " ms ("
+         << pixels*1000/max<int64_t>(ms, 1) << " pixels/s)" << endl;
 }
 
-void RayTracer::loadBalance(vector<JobData> &jobs, atomic<uint> &jobsLeft, mutex &lbMutex, condition_variable &lbCv) const {
-    unique_lock<mutex> l(lbMutex);
-    while (jobsLeft > 0) {
-        // NB: This may be missed, but still correct (want to avoid signals immediately after lb finishes
-        lbCv.wait_for(l, std::chrono::seconds(10));
-        if (jobsLeft < 100*jobs.size()) {
-            // Stop load balancing when there are not enough jobs to be worthwhile
-            cout << "Stopping load balancing... " << jobsLeft << " jobs left" << endl;
-            break;
+void RayTracer::traceTiles(RenderJob &job, uint id) const {
+    // NB: No tiles are pushed once rendering starts, so a failed steal only means another thief
+    // got there first and we go round again until every tile has been claimed
+    uint32_t t;
+    auto &deques = job.deques;
+    while (job.tilesLeft.load(memory_order_relaxed) > 0) {
+        bool found = deques[id]->pop(t);
+        for (uint k = 1; !found && k < deques.size(); ++k) {
+            found = deques[(id + k) % deques.size()]->steal(t);
+            if (found) {
+                job.tilesStolen.fetch_add(1, memory_order_relaxed);
+            }
         }
 
-        for (auto &job : jobs) {
-            job.queueMutex.lock();
+        if (!found) {
+            this_thread::yield();
+            continue;
         }
 
-        // Rebalance all the queues (pseudo-uniform [sic])
-        vector<queue<pair<uint, uint>>> aux(jobs.size());
-        queue<pair<uint, uint>> src;
-        uint perQueue = jobsLeft / jobs.size();
-        for (auto &job : jobs) {
-            while (job.jobsQueue.size() > perQueue) {
-                src.emplace(job.jobsQueue.front());
-                job.jobsQueue.pop();
+        job.tilesLeft.fetch_sub(1, memory_order_relaxed);
+        auto begin = chrono::steady_clock::now();
+        const auto &tile = job.tiles[t];
+        for (uint j = tile.y0; j < tile.y1; ++j) {
+            for (uint i = tile.x0; i < tile.x1; ++i) {
+                tracePixel(job, i, j);
             }
         }
+        job.times[t] = chrono::duration<float>(chrono::steady_clock::now() - begin).count();
+    }
+}
 
-        // Get each queue up to perQueue
-        for (auto &job : jobs) {
-            while (job.jobsQueue.size() < perQueue && !src.empty()) {
-                job.jobsQueue.emplace(src.front());
-                src.pop();
-            }
+vector<float> RayTracer::estimateCosts(const RenderJob &job) const {
+    vector<float> costs(job.tiles.size());
+    auto last = atomic_load(&lastCosts);
+    if (tileCost == COST_PREVIOUS && last != nullptr &&
+        last->width == job.img.width() && last->height == job.img.height() && last->size == tileSize)
+    {
+        for (size_t t = 0; t < job.tiles.size(); ++t) {
+            costs[t] = last->cost[last->cell(job.tiles[t])];
         }
+        return costs;
+    }
 
-        // Add unbalanced jobs in round robin
-        uint i = 0;
-        while (!src.empty()) {
-            jobs[i % jobs.size()].jobsQueue.emplace(src.front());
-            src.pop();
-            i++;
+    // Prepass, time one primary ray through the middle of each quarter of every tile
+    // NB: A tile whose rays are the first to reach a lazily built mesh also pays for that build
+    auto begin = chrono::steady_clock::now();
+    auto &pool = ThreadPool::global();
+    uint tasks = pool.size();
+    pool.parallelFor(tasks, [&](uint k) {
+        for (size_t t = k; t < job.tiles.size(); t += tasks) {
+            const auto &tile = job.tiles[t];
+            float tw = tile.x1 - tile.x0, th = tile.y1 - tile.y0;
+            auto start = chrono::steady_clock::now();
+            for (auto fx : {0.25f, 0.75f}) {
+                for (auto fy : {0.25f, 0.75f}) {
+                    raycolor(eye, pixelDir(job, tile.x0 + fx*tw, tile.y0 + fy*th));
+                }
+            }
+            costs[t] = chrono::duration<float>(chrono::steady_clock::now() - start).count();
         }
+    });
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - begin).count();
+    cout << "Tile cost prepass: " << job.tiles.size() << " tiles in " << ms << " ms" << endl;
+    return costs;
+}
 
-        cout << "Queue Sizes: ";
-        for (uint i = 0; i < jobs.size(); ++i) {
-            auto &job = jobs[i];
-            cout << job.jobsQueue.size() << " ";
-            job.queueMutex.unlock();
-        }
-        cout << endl;
-    }
+glm::vec3 RayTracer::pixelDir(const RenderJob &job, float x, float y) const {
+    auto us = x*job.impW/float(job.img.width());
+    auto vs = y*impH/float(job.img.height());
+    auto s = job.l + u*us + v*vs;
+    return glm::normalize(s - eye);
 }
 
-void RayTracer::tracePixel(const glm::vec3 &l, Image &img, uint i, uint j) const {
+void RayTracer::tracePixel(RenderJob &job, uint i, uint j) const {
     // NB: See http://stackoverflow.com/questions/686353/c-random-float-number-generation
     thread_local random_device rd;
     thread_local mt19937 e2(rd());
-    thread_local uniform_real_distribution<float> dist(0, SUBSAMPLE_DIV);
+    thread_local uniform_real_distribution<float> dist(0, 1);
 
-    // Stratified supersampling
+    glm::vec2 xy[PIXEL_MAX_SAMPLES];
+    glm::vec3 cols[PIXEL_MAX_SAMPLES];
+    uint weights[PIXEL_MAX_SAMPLES];
     glm::vec3 col(0, 0, 0);
-    for (float p = 0; p < SUBSAMPLES; ++p) {
-        for (float q = 0; q < SUBSAMPLES; ++q) {
-            // Pixel location on image plane
-            auto us = (i + (p + dist(e2)/SUBSAMPLES))*impW/float(img.width());
-            auto vs = (j + (q + dist(e2)/SUBSAMPLES))*impH/float(img.height());
-            auto s = l + u*us + v*vs;
-            auto dir = glm::normalize(s - eye);
-
-            // Compute the color for the ray
-            col += raycolor(eye, dir);
+    if (sampling.mode == SampleConfig::FIXED) {
+        // Stratified supersampling
+        uint n = 0;
+        for (float p = 0; p < SUBSAMPLES; ++p) {
+            for (float q = 0; q < SUBSAMPLES; ++q) {
+                // Pixel location on image plane
+                xy[n++] = glm::vec2(i + (p + dist(e2))*SUBSAMPLE_DIV, j + (q + dist(e2))*SUBSAMPLE_DIV);
+            }
+        }
+
+        // Compute the color for the rays
+        uint m = traceSamples(job, xy, n, cols, weights);
+        for (uint k = 0; k < m; ++k) {
+            col += cols[k]*float(weights[k]);
         }
+        col /= float(SUBSAMPLES*SUBSAMPLES);
+        job.samples.fetch_add(SUBSAMPLES*SUBSAMPLES, memory_order_relaxed);
+    } else {
+        // Rounds of stratified samples until the pixel's noise is under the threshold, PROGRESSIVE
+        // only takes one round per call (after the minimum) and keeps the sums for the next
+        PixelSamples local;
+        auto &px = sampling.mode == SampleConfig::PROGRESSIVE ? job.pixels[size_t(j)*job.img.width() + i] : local;
+        if (px.done) {
+            return;
+        }
+        auto enough = [&]() {
+            return px.n >= sampling.maxSamples || (px.n >= sampling.minSamples && px.error() <= sampling.threshold);
+        };
+
+        auto first = px.n;
+        do {
+            uint n = 0;
+            for (uint p = 0; p < ROUND_STRATA; ++p) {
+                for (uint q = 0; q < ROUND_STRATA; ++q) {
+                    xy[n++] = glm::vec2(i + (p + dist(e2))/ROUND_STRATA, j + (q + dist(e2))/ROUND_STRATA);
+                }
+            }
+            uint m = traceSamples(job, xy, n, cols, weights);
+            for (uint k = 0; k < m; ++k) {
+                px.add(cols[k], weights[k]);
+            }
+        } while (!enough() && (sampling.mode == SampleConfig::ADAPTIVE || px.n < sampling.minSamples));
+
+        px.done = enough();
+        if (px.done && sampling.mode == SampleConfig::PROGRESSIVE) {
+            job.unconverged.fetch_sub(1, memory_order_relaxed);
+        }
+        col = px.sum / float(px.n);
+        job.samples.fetch_add(px.n - first, memory_order_relaxed);
     }
 
-    col /= float(SUBSAMPLES*SUBSAMPLES);
-    img(i, j, 0) = col.r;
-    img(i, j, 1) = col.g;
-    img(i, j, 2) = col.b;
+    job.img(i, j, 0) = col.r;
+    job.img(i, j, 1) = col.g;
+    job.img(i, j, 2) = col.b;
 }
 
-glm::vec3 RayTracer::raycolor(const glm::vec3 &eye, const glm::vec3 &dir, int depth) const {
+uint RayTracer::traceSamples(const RenderJob &job, const glm::vec2 *xy, uint n, glm::vec3 *cols, uint *weights) const {
+    if (!sampling.decoupled) {
+        for (uint k = 0; k < n; ++k) {
+            cols[k] = raycolor(eye, pixelDir(job, xy[k].x, xy[k].y));
+            weights[k] = 1;
+        }
+        return n;
+    }
+
+    // Find every sample's surface first, group[k] is the first sample on the same surface (and material)
+    // as sample k, or -1 for the background
+    HitRecord hrs[PIXEL_MAX_SAMPLES];
+    int group[PIXEL_MAX_SAMPLES];
+    for (uint k = 0; k < n; ++k) {
+        group[k] = closestHit(eye, pixelDir(job, xy[k].x, xy[k].y), hrs[k]) ? k : -1;
+        for (uint g = 0; g < k && group[k] == int(k); ++g) {
+            if (group[g] == int(g) && hrs[g].surf == hrs[k].surf && hrs[g].inst == hrs[k].inst && hrs[g].mat == hrs[k].mat) {
+                group[k] = g;
+            }
+        }
+    }
+
+    // Shade each group once, at its sample nearest the pixel centre, with its share of the shadow rays
+    // one sample would get
+    auto centre = glm::floor(xy[0]) + glm::vec2(0.5f);
+    int best[PIXEL_MAX_SAMPLES];
+    uint coverage[PIXEL_MAX_SAMPLES];
+    for (uint k = 0; k < n; ++k) {
+        if (group[k] == int(k)) {
+            best[k] = k;
+            coverage[k] = 1;
+        } else if (group[k] >= 0) {
+            coverage[group[k]]++;
+            if (glm::distance(xy[k], centre) < glm::distance(xy[best[group[k]]], centre)) {
+                best[group[k]] = k;
+            }
+        }
+    }
+    uint m = 0, misses = n;
+    for (uint k = 0; k < n; ++k) {
+        if (group[k] == int(k)) {
+            cols[m] = shade(eye, hrs[best[k]], 0, float(coverage[k])/n);
+            weights[m++] = coverage[k];
+            misses -= coverage[k];
+        }
+    }
+
+    // The background is one more (black) shading
+    if (misses > 0) {
+        cols[m] = glm::vec3();
+        weights[m++] = misses;
+    }
+    return m;
+}
+
+bool RayTracer::closestHit(const glm::vec3 &eye, const glm::vec3 &dir, HitRecord &hr) const {
     // Find surface with minimum intersection for ray
-    HitRecord minHr{std::numeric_limits<float>::max(), eye, dir, nullptr, glm::vec3(), glm::vec2()};
-    if (!intersect(eye, dir, minHr)) {
-        // TODO: Add background if no intersection found
-        return glm::vec3();
+    hr = HitRecord{std::numeric_limits<float>::max(), dir, eye, nullptr, glm::vec3(), glm::vec2()};
+    if (!intersect(eye, dir, hr)) {
+        return false;
     }
 
-    return shade(eye, minHr, depth);
+    if (hr.inst != nullptr) {
+        hr.inst->finalize(hr);
+    } else {
+        hr.surf->finalize(hr);
+    }
+    return true;
+}
 
+glm::vec3 RayTracer::raycolor(const glm::vec3 &eye, const glm::vec3 &dir, int depth, float coverage) const {
+    HitRecord minHr;
+    if (!closestHit(eye, dir, minHr)) {
+        // TODO: Add background if no intersection found
+        return glm::vec3();
+    }
+    return shade(eye, minHr, depth, coverage);
 }
 
 bool RayTracer::intersect(
@@ -171,24 +457,20 @@ bool RayTracer::intersect(
     HitRecord &minHr,
     std::pair<float, float> rng) const
 {
-    for (const auto &obj: objs) {
-        HitRecord hr{std::numeric_limits<float>::max(), dir, eye, nullptr, glm::vec3()};
-        if (obj->intersect(eye, dir, hr, rng)) {
-            if (hr.t < minHr.t) {
-                minHr = hr;
-                rng.second = min(rng.second, hr.t);
-            }
-        }
-    }
+    BVH_STAT(rays);
+    return scene->intersect(eye, dir, minHr, rng);
+}
 
-    return minHr.surf != nullptr;
+bool RayTracer::occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const {
+    BVH_STAT(rays);
+    return scene->occluded(eye, dir, tmax);
 }
 
-glm::vec3 RayTracer::shade(const glm::vec3 &eye, const HitRecord &hr, int depth) const {
+glm::vec3 RayTracer::shade(const glm::vec3 &eye, const HitRecord &hr, int depth, float coverage) const {
     auto int_pt = eye + hr.dir*hr.t;
     auto v = -hr.dir;
     // Surface params
-    const auto &mat = hr.surf->getMaterial();
+    const auto &mat = *hr.mat;
 
     // Local random device since rng is not threadsafe
     thread_local random_device rd;
@@ -199,21 +481,40 @@ glm::vec3 RayTracer::shade(const glm::vec3 &eye, const HitRecord &hr, int depth)
 
     // Add color contribution for each light
     for (const auto &light : lights) {
+        uint budget = SHADOWSAMPLES;
+        if (sampling.adaptiveShadows) {
+            // Solid angle of the light's sphere seen from int_pt
+            auto sinT = glm::min(1.0f, light->rad / glm::length(light->pos - int_pt));
+            auto solidAngle = 2*glm::pi<float>()*(1 - glm::sqrt(1 - sinT*sinT));
+            budget = glm::clamp(uint(glm::ceil(SHADOW_SAMPLES_PER_SR*solidAngle)), uint(SHADOWSAMPLES), SHADOW_MAX_SAMPLES);
+        }
+
+        // NB: Decoupled shading splits one sample's budget between the surfaces a pixel's samples hit (by
+        // how many samples hit each), a share smaller than the probes is cast in full
+        budget = max(1u, uint(glm::round(budget*coverage)));
+
         glm::vec3 lightCol(0, 0, 0);
-        for (uint i = 0; i < SHADOWSAMPLES; ++i) {
+        uint n = 0, lit = 0;
+        for (; n < budget; ++n) {
+            // Fully lit or fully shadowed if the probes agree
+            // NB: Occluders thin enough to slip between every probe are missed
+            if (sampling.adaptiveShadows && n == SHADOW_PROBES && (lit == 0 || lit == n)) {
+                break;
+            }
+
             auto lightDir = light->sample(dist(e2), dist(e2), dist(e2)) - int_pt;
             auto lightDist = glm::length(lightDir);
             lightDir = glm::normalize(lightDir);
             auto halfVec = glm::normalize(lightDir + v);
 
             // Check if in shadow by sending shadow ray to light source
-            HitRecord shadHr{std::numeric_limits<float>::max(), int_pt + EPS*lightDir, lightDir, nullptr, glm::vec3(), glm::vec2()};
-            if (intersect(int_pt + EPS*lightDir, lightDir, shadHr, make_pair(0, lightDist + 2*light->rad))) {
+            if (occluded(int_pt + EPS*lightDir, lightDir, lightDist + 2*light->rad)) {
                 // Don't shade if in shadow of another surface
                 continue;
             }
 
             // TODO: Attenuate light based on distance?
+            lit++;
             auto intensity = light->intensity;
             auto diffMag = max(0.0f, glm::dot(hr.norm, lightDir));
             float specMag = 0;
@@ -226,7 +527,7 @@ glm::vec3 RayTracer::shade(const glm::vec3 &eye, const HitRecord &hr, int depth)
             lightCol.b += kd.b*intensity.b*diffMag + ks.b*intensity.b*specMag;
         }
 
-        lightCol /= SHADOWSAMPLES;
+        lightCol /= float(n);
         col += lightCol;
     }
 
@@ -234,16 +535,30 @@ glm::vec3 RayTracer::shade(const glm::vec3 &eye, const HitRecord &hr, int depth)
     if (mat.mirror && depth < MAX_DEPTH) {
         auto r = glm::normalize(hr.dir - 2*(glm::dot(hr.dir, hr.norm))*hr.norm);
         auto km = mat.km->getCol(hr.uv);
-        col += km * raycolor(int_pt + EPS*r, r, depth + 1);
+        col += km * raycolor(int_pt + EPS*r, r, depth + 1, coverage);
     }
 
     return col;
 }
 
+bool RayTracer::setTileCost(const string &name) {
+    if (name == "none") {
+        tileCost = COST_NONE;
+    } else if (name == "prepass") {
+        tileCost = COST_PREPASS;
+    } else if (name == "previous") {
+        tileCost = COST_PREVIOUS;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 bool RayTracer::addObject(shared_ptr<Object> obj, string name) {
     if (!objNames.count(name)) {
         objNames[name] = objs.size();
         objs.emplace_back(obj);
+        scene.reset();
         return true;
     }
 
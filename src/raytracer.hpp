@@ -8,18 +8,51 @@
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 #include <atomic>
-#include <condition_variable>
+#include <algorithm>
 
 #include "image.hpp"
 #include "light.hpp"
 #include "surface.hpp"
+#include "bvh.hpp"
+#include "tiles.hpp"
+#include "threadpool.hpp"
 
 using namespace std;
 
-const static float DEFAULT_ASPECT_RATIO = 1.0f;
+struct RenderJob;
+
 const static float MAX_DEPTH = 10;
 
-struct JobData;
+// How many primary (and shadow) rays each pixel gets
+struct SampleConfig {
+    enum {
+        FIXED,       // A jittered 4x4 grid
+        ADAPTIVE,    // Jittered 2x2 rounds until the pixel's noise is under threshold (or maxSamples)
+        PROGRESSIVE  // Adaptive rounds over the whole image, stopping once few enough pixels are noisy
+    } mode;
+
+    SampleConfig() :
+        mode(FIXED), minSamples(4), maxSamples(64), threshold(0.01f), converged(0.001f), adaptiveShadows(true),
+        decoupled(false) { }
+
+    // Set mode by name (fixed, adaptive, progressive), returns false if unknown
+    bool setMode(const string &name);
+
+    uint minSamples, maxSamples;  // Per pixel (rounded up to whole rounds)
+    float threshold;              // Standard error of a pixel's mean luminance that counts as converged
+    float converged;              // PROGRESSIVE stops once this fraction of pixels (or less) are unconverged
+
+    // Probe each light with a few shadow rays and only cast the rest in penumbrae (as many as the light's
+    // solid angle calls for), otherwise every shaded point casts SHADOWSAMPLES per light
+    bool adaptiveShadows;
+
+    // Shade each distinct surface (and material) a pixel's samples hit once, at the sample nearest the
+    // pixel centre, weighted by how many samples hit it (like MSAA), instead of shading every sample
+    // NB: Loses detail finer than a pixel within a surface (eg. texture, specular highlights), and the
+    // surfaces share one sample's shadow rays so soft shadows are noisier. Adaptive sampling weights each
+    // shading by its samples, so a pixel within one surface converges at minSamples whatever its shadows.
+    bool decoupled;
+};
 
 class RayTracer {
 public:
@@ -29,6 +62,9 @@ public:
         glm::vec3 up,
         float fovy) :
             numThreads(numThreads),
+            tileSize(TILES_DEFAULT_SIZE),
+            tileOrder(TILES_HILBERT),
+            tileCost(COST_NONE),
             eye(eye),
             lookAt(lookAt),
             u(glm::normalize(up)),
@@ -40,14 +76,35 @@ public:
         v = glm::cross(w, u);
 
         // Compute the image dimensions
+        // NB: The width follows from the aspect ratio of each rendered image
         impH = glm::tan(glm::radians(this->fovy/2)) * 2 * focalLength;
-        impW = impH * DEFAULT_ASPECT_RATIO; // Override with render aspect ratio
     }
 
     void render(Image &img);
+
+    // Queue a render of img on the global ThreadPool, img is complete once the pool has waited on group
+    // NB: Several renders may be queued at once, but objects and lights must not change until they finish
+    void submit(Image &img, ThreadPool::Group &group);
     bool addObject(shared_ptr<Object> obj, string name);
     bool addLight(shared_ptr<Light> l, string name);
 
+    // Side of the square pixel tiles handed out to (and stolen between) render threads
+    void setTileSize(uint size) { tileSize = max(size, 1u); }
+
+    // Order tiles are split between threads in (rows, morton, hilbert), returns false if unknown
+    bool setTileOrder(const string &name) { return parseTileOrder(name, tileOrder); }
+
+    // Build parameters of the top level BVH over objects
+    void setBvhConfig(const BvhConfig &cfg) { bvhCfg = cfg; scene.reset(); }
+
+    // Primary rays per pixel (see SampleConfig)
+    void setSampling(const SampleConfig &cfg) { sampling = cfg; }
+
+    // How tile costs are estimated so the most expensive tiles start first, returns false if unknown
+    // none: keep the tile order, prepass: time a few primary rays per tile before rendering,
+    // previous: reuse the timings of the last render of the same size (a prepass if there is none)
+    bool setTileCost(const string &name);
+
 private:
     bool intersect(
         const glm::vec3 &eye,
@@ -55,17 +112,52 @@ private:
         HitRecord &hr,
         pair<float, float> rng = make_pair(0, numeric_limits<float>::max())) const;
 
-    // Worker job to return color per pixel
-    void traceRows(const glm::vec3 &l, JobData &job, atomic<uint> &jobsLeft, Image &img, condition_variable &lbCv) const;
-    void tracePixel(const glm::vec3 &l, Image &img, uint i, uint j) const;
-    void loadBalance(vector<JobData> &jobs, atomic<uint> &jobsLeft, mutex &lbMutex, condition_variable &lbCv) const;
+    // Returns true if anything is hit within (0, tmax) (for shadow rays)
+    bool occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const;
 
-    // Shade a pixel using the HitRecord for the ray through that pixel
-    glm::vec3 shade(const glm::vec3 &eye, const HitRecord &hr, int depth = 0) const;
-    glm::vec3 raycolor(const glm::vec3 &eye, const glm::vec3 &dir, int depth = 0) const;
+    // Queue a round of render tasks over job's tiles (costs are sorted estimates, or empty to keep the order)
+    void submitRound(shared_ptr<RenderJob> job, const vector<float> &costs, ThreadPool::Group &group);
+
+    // Run by the last task of each round, queues the next round if progressive sampling has one
+    void finishRound(shared_ptr<RenderJob> job, ThreadPool::Group &group);
+
+    // Render task, traces tiles from its own deque then steals from the others until none are left
+    void traceTiles(RenderJob &job, uint id) const;
+    void tracePixel(RenderJob &job, uint i, uint j) const;
+
+    // Shade the primary rays through pixel positions xy[0, n) of one pixel, returns the number of shadings
+    // m and sets cols[0, m) and the number of rays each stands for in weights[0, m) (one each unless
+    // SampleConfig::decoupled)
+    uint traceSamples(const RenderJob &job, const glm::vec2 *xy, uint n, glm::vec3 *cols, uint *weights) const;
+
+    // Direction of the primary ray through image position (x, y) in pixels
+    glm::vec3 pixelDir(const RenderJob &job, float x, float y) const;
+
+    // Estimated cost of each of job's tiles (see setTileCost)
+    vector<float> estimateCosts(const RenderJob &job) const;
+
+    // Closest surface hit by a ray, finalized for shading
+    bool closestHit(const glm::vec3 &eye, const glm::vec3 &dir, HitRecord &hr) const;
+
+    // Shade a pixel using the HitRecord for the ray through that pixel, casting coverage (the fraction of
+    // the pixel's samples it stands for when decoupled) of a sample's shadow rays
+    glm::vec3 shade(const glm::vec3 &eye, const HitRecord &hr, int depth = 0, float coverage = 1) const;
+    glm::vec3 raycolor(const glm::vec3 &eye, const glm::vec3 &dir, int depth = 0, float coverage = 1) const;
 
 private:
     uint numThreads;
+    uint tileSize;
+    TileOrder tileOrder;
+    SampleConfig sampling;
+    enum {
+        COST_NONE,
+        COST_PREPASS,
+        COST_PREVIOUS
+    } tileCost;
+
+    // Tile timings of the last finished render
+    // NB: Only accessed with atomic_load/atomic_store since renders finish on pool threads
+    shared_ptr<const TileCosts> lastCosts;
 
     // View parameters
     glm::vec3 eye;
@@ -75,7 +167,6 @@ private:
 
     // Image plane dimensions
     float impH;
-    float impW;
 
     // Light parameters
     vector<shared_ptr<Light>> lights;
@@ -84,5 +175,9 @@ private:
     // Objects in world
     vector<shared_ptr<Object>> objs;
     map<string, int> objNames;
+
+    // Acceleration structure over objs (built by the first render after objs or bvhCfg change)
+    BvhConfig bvhCfg;
+    unique_ptr<SceneBvh> scene;
 };
 #endif
@@ -12,11 +12,11 @@ float discriminant(float a, float b, float c) {
     return b*b - 4*a*c;
 }
 
-bool Sphere::intersect(
+bool Sphere::hit(
     const glm::vec3 &eye,
     const glm::vec3 &dir,
-    HitRecord &hr,
-    const std::pair<float, float> &rng) const {
+    const std::pair<float, float> &rng,
+    float &t) const {
     auto eyeC = eye - c;
     auto a = glm::dot(dir, dir),
          b = glm::dot(2.0f*dir, eyeC),
@@ -30,23 +30,51 @@ bool Sphere::intersect(
     float t1 = (-b - std::sqrt(d))/(2*a),
           t2 = (-b + std::sqrt(d))/(2*a);
 
-    if (t1 > rng.first && t1 < rng.second && t1 < hr.t) {
-        hr.t = t1;
-        hr.surf = this;
-        hr.norm = getNorm(eye + hr.t*dir);
-        hr.uv = getUV(eye + hr.t*dir);
+    if (t1 > rng.first && t1 < rng.second) {
+        t = t1;
         return true;
     }
-    if (t2 > rng.first && t2 < rng.second && t2 < hr.t) {
-        hr.t = t2;
-        hr.surf = this;
-        hr.norm = getNorm(eye + hr.t*dir);
-        hr.uv = getUV(eye + hr.t*dir);
+    if (t2 > rng.first && t2 < rng.second) {
+        t = t2;
         return true;
     }
     return false;
 }
 
+bool Sphere::intersect(
+    const glm::vec3 &eye,
+    const glm::vec3 &dir,
+    HitRecord &hr,
+    const std::pair<float, float> &rng) const {
+    float t;
+    if (!hit(eye, dir, std::make_pair(rng.first, std::min(rng.second, hr.t)), t)) {
+        return false;
+    }
+
+    hr.t = t;
+    hr.surf = this;
+    hr.inst = nullptr;
+    return true;
+}
+
+bool Sphere::occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const {
+    float t;
+    return hit(eye, dir, std::make_pair(0.0f, tmax), t);
+}
+
+void Sphere::finalize(HitRecord &hr) const {
+    auto p = hr.eye + hr.t*hr.dir;
+    hr.norm = getNorm(p);
+    hr.uv = getUV(p);
+    hr.mat = &getMaterial();
+}
+
+bool Sphere::getBounds(AABB &box) const {
+    box.update(c - glm::vec3(rad));
+    box.update(c + glm::vec3(rad));
+    return true;
+}
+
 glm::vec3 Sphere::getNorm(const glm::vec3 &pos) const {
     return glm::normalize(pos - c);
 }
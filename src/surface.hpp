@@ -5,8 +5,10 @@
 #include <glm/glm.hpp>
 
 #include "material.hpp"
+#include "aabb.hpp"
 
 class Surface;
+class Instance;
 
 struct HitRecord {
     float t;
@@ -15,8 +17,18 @@ struct HitRecord {
 
     // A HitRecord should _never_ outlive surface it hits
     const Surface *surf;
+
+    // Only valid after Surface::finalize
     glm::vec3 norm;
     glm::vec2 uv;
+    const Material *mat;
+
+    // Set by intersect for the closest hit so far
+    glm::vec2 bary; // Barycentrics of 2nd and 3rd vertex (triangles)
+    uint32_t prim;  // Primitive within surf (eg. triangle of a mesh)
+
+    // Instance surf was hit through (nullptr if none), set along with surf
+    const Instance *inst;
 };
 
 // An Object instance is something a ray can intersect
@@ -26,35 +38,41 @@ public:
     virtual ~Object() { }
 
     // intersect _must_ set hr.surf and h.t iff intersection found
+    // NB: Shading attributes are not computed here, see Surface::finalize
     virtual bool intersect(
         const glm::vec3 &eye,
         const glm::vec3 &dir,
         HitRecord &hr,
         const std::pair<float, float> &rng) const = 0;
+
+    // Any hit query (eg. shadow rays), true if something is hit in (0, tmax)
+    // NB: May return on the first hit found and never computes shading attributes
+    virtual bool occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const = 0;
+
+    // Grows box by the world space bounds, returns false if unbounded (eg. planes)
+    virtual bool getBounds(AABB &box) const = 0;
 };
 
 
 // A Surface instance is geometry that can be intersected
 class Surface : public Object {
 public:
-    Surface(std::shared_ptr<Material> mat) : mat(mat) { }
+    Surface(MaterialPtr mat) : mat(mat) { }
     virtual ~Surface() { }
 
-    // Get the normal to the surface at a point p on the surface
-    // NB: Very weird... each in coordinate system of derived class
-    // eg) triangle is barycentric, sphere is world
-    // TODO: FIX THIS
-    virtual glm::vec3 getNorm(const glm::vec3 &p) const = 0;
-    virtual glm::vec2 getUV(const glm::vec3 &p) const = 0;
     const Material& getMaterial() const { return *mat.get(); }
+
+    // Fill in hr.norm, hr.uv and hr.mat once traversal has found the closest hit
+    // NB: Each surface interprets the hit its own way (eg. triangle uses barycentrics, sphere the position)
+    virtual void finalize(HitRecord &hr) const = 0;
 private:
-    std::shared_ptr<Material> mat;
+    MaterialPtr mat;
 };
 
 
 class Sphere : public Surface {
 public:
-    Sphere(glm::vec3 c, float rad, std::shared_ptr<Material> mat) :
+    Sphere(glm::vec3 c, float rad, MaterialPtr mat) :
         Surface(mat), c(c), rad(rad) { }
     virtual ~Sphere() { }
 
@@ -63,8 +81,14 @@ public:
         const glm::vec3 &dir,
         HitRecord &hr,
         const std::pair<float, float> &rng) const;
+    bool occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const;
+    bool getBounds(AABB &box) const;
     glm::vec3 getNorm(const glm::vec3 &p) const;
     glm::vec2 getUV(const glm::vec3 &p) const;
+    void finalize(HitRecord &hr) const;
+private:
+    // Nearest root in rng (if any)
+    bool hit(const glm::vec3 &eye, const glm::vec3 &dir, const std::pair<float, float> &rng, float &t) const;
 private:
     glm::vec3 c;
     float rad;
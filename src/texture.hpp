@@ -27,5 +27,5 @@ private:
     glm::vec3 col;
 };
 
-typedef std::shared_ptr<Texture> TexturePtr;
+typedef std::shared_ptr<const Texture> TexturePtr;
 #endif
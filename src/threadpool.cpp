@@ -0,0 +1,106 @@
+#include "threadpool.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+// Group of the task running on this thread (see Group::Group)
+static thread_local ThreadPool::Group *runningGroup = nullptr;
+
+ThreadPool::Group::Group() : parent(runningGroup), pending(0) { }
+
+bool ThreadPool::Group::within(const Group &group) const {
+    for (auto g = this; g != nullptr; g = g->parent) {
+        if (g == &group) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ThreadPool::ThreadPool(uint threads) : stopping(false) {
+    for (uint i = 1; i < max(threads, 1u); ++i) {
+        workers.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> l(lock);
+        stopping = true;
+    }
+    queued.notify_all();
+    for (auto &w : workers) {
+        w.join();
+    }
+}
+
+static uint globalThreads = 0;
+
+ThreadPool &ThreadPool::global() {
+    static ThreadPool pool(globalThreads > 0 ? globalThreads : max(thread::hardware_concurrency(), 1u));
+    return pool;
+}
+
+void ThreadPool::setGlobalThreads(uint threads) {
+    globalThreads = threads;
+}
+
+void ThreadPool::submit(Group &group, function<void()> task) {
+    {
+        lock_guard<mutex> l(lock);
+        group.pending++;
+        tasks.push_back(Task{&group, move(task)});
+    }
+    queued.notify_one();
+}
+
+void ThreadPool::wait(Group &group) {
+    unique_lock<mutex> l(lock);
+    while (group.pending > 0) {
+        auto it = find_if(tasks.begin(), tasks.end(), [&](const Task &t) { return t.group->within(group); });
+        if (it == tasks.end()) {
+            // The rest are running on other threads
+            finished.wait(l);
+            continue;
+        }
+
+        auto task = move(*it);
+        tasks.erase(it);
+        l.unlock();
+        run(task);
+        l.lock();
+    }
+}
+
+void ThreadPool::run(Task &task) {
+    auto outer = runningGroup;
+    runningGroup = task.group;
+    task.fn();
+    runningGroup = outer;
+    finish(*task.group);
+}
+
+void ThreadPool::finish(Group &group) {
+    {
+        lock_guard<mutex> l(lock);
+        group.pending--;
+    }
+    finished.notify_all();
+}
+
+void ThreadPool::work() {
+    unique_lock<mutex> l(lock);
+    while (true) {
+        queued.wait(l, [this]() { return stopping || !tasks.empty(); });
+        if (tasks.empty()) {
+            return;
+        }
+
+        auto task = move(tasks.front());
+        tasks.pop_front();
+        l.unlock();
+        run(task);
+        l.lock();
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string>
+
+// Long lived worker threads shared by scene loading, BVH builds, rendering and image encoding
+// NB: A thread waiting on a group runs that group's queued tasks itself (and those of groups nested in
+// it, and only those), so tasks can submit and wait on nested groups without deadlocking even when every
+// worker is busy, and threads waiting on a task help with whatever it is waiting on in turn
+class ThreadPool {
+public:
+    // Tasks that are waited on together
+    class Group {
+    public:
+        // Nested in the group of the task running on this thread (if any)
+        // NB: So such a group must not outlive that task (it is normally a local of it)
+        Group();
+        // Nested in parent (none for a group that outlives the task creating it)
+        explicit Group(Group *parent) : parent(parent), pending(0) { }
+        Group(const Group &) = delete;
+        Group &operator=(const Group &) = delete;
+    private:
+        friend class ThreadPool;
+
+        // This is group or nested in it
+        bool within(const Group &group) const;
+
+        Group *parent;
+        uint pending;  // NB: Guarded by the pool's lock
+    };
+
+    // threads - 1 workers, the thread waiting on a group makes up the last one
+    explicit ThreadPool(uint threads);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Process wide pool, created on first use with the last setGlobalThreads (hardware concurrency by default)
+    static ThreadPool &global();
+    static void setGlobalThreads(uint threads);
+
+    uint size() const { return workers.size() + 1; }
+
+    void submit(Group &group, std::function<void()> task);
+
+    // Block until every task submitted to group has finished
+    void wait(Group &group);
+
+    // Run fn(0) ... fn(n - 1) as tasks (fn(0) on the caller's thread) and wait for all of them
+    template <typename Fn>
+    void parallelFor(uint n, Fn fn) {
+        Group group;
+        for (uint i = 1; i < n; ++i) {
+            submit(group, [&fn, i]() { fn(i); });
+        }
+        if (n > 0) {
+            fn(0);
+        }
+        wait(group);
+    }
+
+private:
+    struct Task {
+        Group *group;
+        std::function<void()> fn;
+    };
+
+    void work();
+    void run(Task &task);
+    void finish(Group &group);
+
+    std::mutex lock;
+    std::condition_variable queued;    // Workers wait for tasks (or stopping)
+    std::condition_variable finished;  // Waiters wait for their group's tasks
+    std::deque<Task> tasks;
+    std::vector<std::thread> workers;
+    bool stopping;
+};
+#endif
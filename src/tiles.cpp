@@ -0,0 +1,188 @@
+#include "tiles.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+bool parseTileOrder(const string &name, TileOrder &order) {
+    if (name == "rows") {
+        order = TILES_ROWS;
+    } else if (name == "morton") {
+        order = TILES_MORTON;
+    } else if (name == "hilbert") {
+        order = TILES_HILBERT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Interleave the bits of x and y (x in the even bits)
+static uint64_t mortonIndex(uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint b = 0; b < 32; ++b) {
+        d |= uint64_t((x >> b) & 1) << (2*b) | uint64_t((y >> b) & 1) << (2*b + 1);
+    }
+    return d;
+}
+
+// Distance of (x, y) along the Hilbert curve filling an n x n grid (n a power of 2)
+static uint64_t hilbertIndex(uint32_t n, uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = n/2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+        d += uint64_t(s)*s*((3*rx) ^ ry);
+
+        // Rotate the quadrant so the sub curve starts and ends where the next one expects
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - (x & (s - 1));
+                y = s - 1 - (y & (s - 1));
+            }
+            swap(x, y);
+        }
+    }
+    return d;
+}
+
+vector<Tile> makeTiles(uint width, uint height, uint size, TileOrder order) {
+    size = max(size, 1u);
+    uint cols = (width + size - 1) / size, rows = (height + size - 1) / size;
+    uint32_t n = 1;
+    while (n < max(cols, rows)) {
+        n <<= 1;
+    }
+
+    vector<pair<uint64_t, Tile>> keyed;
+    keyed.reserve(cols*rows);
+    for (uint ty = 0; ty < rows; ++ty) {
+        for (uint tx = 0; tx < cols; ++tx) {
+            uint64_t key = uint64_t(ty)*cols + tx;
+            if (order == TILES_MORTON) {
+                key = mortonIndex(tx, ty);
+            } else if (order == TILES_HILBERT) {
+                key = hilbertIndex(n, tx, ty);
+            }
+            uint x = tx*size, y = ty*size;
+            keyed.emplace_back(key, Tile{x, y, min(x + size, width), min(y + size, height)});
+        }
+    }
+    sort(keyed.begin(), keyed.end(), [](const pair<uint64_t, Tile> &a, const pair<uint64_t, Tile> &b) {
+        return a.first < b.first;
+    });
+
+    vector<Tile> tiles;
+    tiles.reserve(keyed.size());
+    for (const auto &k : keyed) {
+        tiles.push_back(k.second);
+    }
+    return tiles;
+}
+
+void orderByCost(vector<Tile> &tiles, vector<float> &costs) {
+    float mean = 0;
+    for (auto c : costs) {
+        mean += c;
+    }
+    mean /= max<size_t>(tiles.size(), 1);
+
+    vector<pair<float, Tile>> out;
+    vector<pair<float, Tile>> todo;
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        todo.emplace_back(costs[i], tiles[i]);
+    }
+    while (!todo.empty()) {
+        auto c = todo.back().first;
+        auto t = todo.back().second;
+        todo.pop_back();
+        uint xm = (t.x0 + t.x1)/2, ym = (t.y0 + t.y1)/2;
+        if (c <= TILES_SPLIT_COST*mean || (t.x1 - t.x0 < 2 && t.y1 - t.y0 < 2)) {
+            out.emplace_back(c, t);
+            continue;
+        }
+
+        // Halve each axis that is more than a pixel wide
+        vector<Tile> parts;
+        for (auto y : {make_pair(t.y0, ym), make_pair(ym, t.y1)}) {
+            for (auto x : {make_pair(t.x0, xm), make_pair(xm, t.x1)}) {
+                if (x.first < x.second && y.first < y.second) {
+                    parts.push_back(Tile{x.first, y.first, x.second, y.second});
+                }
+            }
+        }
+        for (const auto &p : parts) {
+            todo.emplace_back(c / parts.size(), p);
+        }
+    }
+
+    stable_sort(out.begin(), out.end(), [](const pair<float, Tile> &a, const pair<float, Tile> &b) {
+        return a.first > b.first;
+    });
+    tiles.clear();
+    costs.clear();
+    for (const auto &o : out) {
+        costs.push_back(o.first);
+        tiles.push_back(o.second);
+    }
+}
+
+// NB: Capacity is rounded up to a power of 2 so indices wrap with a mask
+TileDeque::TileDeque(uint capacity) : top(0), bottom(0) {
+    int64_t n = 1;
+    while (n < capacity) {
+        n <<= 1;
+    }
+    mask = n - 1;
+    items.reset(new atomic<uint32_t>[n]);
+}
+
+// NB: Memory orderings follow Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models"
+bool TileDeque::push(uint32_t item) {
+    auto b = bottom.load(memory_order_relaxed);
+    auto t = top.load(memory_order_acquire);
+    if (b - t > mask) {
+        return false;
+    }
+
+    items[b & mask].store(item, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    bottom.store(b + 1, memory_order_relaxed);
+    return true;
+}
+
+bool TileDeque::pop(uint32_t &item) {
+    auto b = bottom.load(memory_order_relaxed) - 1;
+    bottom.store(b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    auto t = top.load(memory_order_relaxed);
+    if (t > b) {
+        // Already empty
+        bottom.store(b + 1, memory_order_relaxed);
+        return false;
+    }
+
+    item = items[b & mask].load(memory_order_relaxed);
+    if (t == b) {
+        // Last item, race thieves for it
+        bool won = top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+        bottom.store(b + 1, memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+bool TileDeque::steal(uint32_t &item) {
+    auto t = top.load(memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    auto b = bottom.load(memory_order_acquire);
+    if (t >= b) {
+        return false;
+    }
+
+    item = items[t & mask].load(memory_order_relaxed);
+    return top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+bool TileDeque::empty() const {
+    return top.load(memory_order_acquire) >= bottom.load(memory_order_acquire);
+}
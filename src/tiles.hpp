@@ -0,0 +1,75 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <string>
+
+#define TILES_DEFAULT_SIZE 16
+
+// Tiles costing more than this times the mean are split by orderByCost
+#define TILES_SPLIT_COST 4.0f
+
+// Pixels [x0, x1) x [y0, y1) of the image
+struct Tile {
+    uint x0, y0, x1, y1;
+};
+
+// Order tiles are handed out in, along a curve consecutive tiles stay adjacent so their rays
+// touch the same BVH nodes, triangles and texels
+enum TileOrder {
+    TILES_ROWS,    // Row major
+    TILES_MORTON,  // Z-order curve (jumps at quadrant boundaries)
+    TILES_HILBERT  // Hilbert curve (each tile borders the next)
+};
+
+// Parse rows, morton or hilbert, returns false if unknown
+bool parseTileOrder(const std::string &name, TileOrder &order);
+
+// Split a width x height image into size x size tiles (edge tiles are clipped)
+// NB: Curves are laid over the smallest power of 2 grid covering the tiles, skipping cells outside
+std::vector<Tile> makeTiles(uint width, uint height, uint size, TileOrder order = TILES_HILBERT);
+
+// Measured cost of each cell of the size x size tile grid over a width x height image
+struct TileCosts {
+    uint width, height, size;
+    std::vector<float> cost;  // Row major cells
+
+    // Cell containing the top left pixel of tile (so split tiles map to the tile they came from)
+    size_t cell(const Tile &tile) const { return (tile.y0/size)*((width + size - 1)/size) + tile.x0/size; }
+};
+
+// Sort tiles (and their costs) most expensive first, after splitting any costing more than
+// TILES_SPLIT_COST times the mean into quarters (sharing its cost) so no tile dominates the tail
+void orderByCost(std::vector<Tile> &tiles, std::vector<float> &costs);
+
+// Lock free Chase-Lev work stealing deque of tile indices
+// NB: Only the owning thread may push and pop (at the bottom), any thread may steal (from the top).
+// The buffer does not grow, so push fails once capacity items are queued.
+class TileDeque {
+public:
+    explicit TileDeque(uint capacity);
+    TileDeque(const TileDeque &) = delete;
+    TileDeque &operator=(const TileDeque &) = delete;
+
+    bool push(uint32_t item);
+    bool pop(uint32_t &item);
+
+    // Returns false if empty, or if another thread took the top item first
+    bool steal(uint32_t &item);
+
+    bool empty() const;
+
+private:
+    int64_t mask;
+    std::unique_ptr<std::atomic<uint32_t>[]> items;
+
+    // NB: Padded onto separate cache lines since thieves hammer top while the owner works on bottom
+    char pad0[64];
+    std::atomic<int64_t> top;
+    char pad1[64];
+    std::atomic<int64_t> bottom;
+};
+#endif
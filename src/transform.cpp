@@ -70,3 +70,16 @@ glm::vec3 TransformChain::norm(const glm::vec3 &norm) const {
     }
     return curr;
 }
+
+glm::mat4 TransformChain::matrix() const {
+    // NB: Transforms apply in order, so later ones multiply on the left
+    glm::mat4 m(1.0f);
+    for (const auto &t : xforms) {
+        m = t->matrix() * m;
+    }
+    return m;
+}
+
+glm::mat4 TransformTrans::matrix() const {
+    return glm::translate(glm::mat4(1.0f), s);
+}
@@ -15,6 +15,9 @@ public:
     virtual ~Transform() { }
     virtual glm::vec3 pos(const glm::vec3 &pos) const { return pos; }
     virtual glm::vec3 norm(const glm::vec3 &norm) const { return norm; }
+
+    // Affine matrix equivalent to pos (eg. to key cached data built with this transform)
+    virtual glm::mat4 matrix() const { return glm::mat4(1.0f); }
 };
 
 
@@ -29,6 +32,7 @@ public:
     virtual ~TransformChain() { }
     glm::vec3 pos(const glm::vec3 &pos) const;
     glm::vec3 norm(const glm::vec3 &norm) const;
+    glm::mat4 matrix() const;
 private:
     vector<TransformPtr> xforms;
 };
@@ -40,6 +44,7 @@ public:
         Transform(), M(M), N(glm::transpose(glm::inverse(M))) { }
     glm::vec3 pos(const glm::vec3 &pos) const;
     glm::vec3 norm(const glm::vec3 &norm) const;
+    glm::mat4 matrix() const { return glm::mat4(M); }
 public:
     static TransformPtr rot(const glm::vec3 &rot, float deg);
     static TransformPtr scale(const glm::vec3 &scale);
@@ -54,6 +59,7 @@ public:
     TransformTrans(const glm::vec3 &trans) : Transform(), s(trans) { }
     glm::vec3 pos(const glm::vec3 &pos) const { return pos + s; }
     glm::vec3 norm(const glm::vec3 &norm) const { return norm; }
+    glm::mat4 matrix() const;
 public:
     static TransformPtr translate(const glm::vec3 &trans);
 private:
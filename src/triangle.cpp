@@ -2,8 +2,6 @@
 
 #include <iostream>
 
-#define EPS 1e-6f
-
 shared_ptr<Plane> Plane::create(glm::vec3 a, glm::vec3 b, glm::vec3 c, MaterialPtr mtl) {
     auto ba = b - a, ca = c - a;
     auto n = glm::normalize(glm::cross(ca, ba));
@@ -15,47 +13,55 @@ shared_ptr<Plane> Plane::create(glm::vec3 a, glm::vec3 b, glm::vec3 c, MaterialP
     );
 }
 
+bool Triangle::hit(
+    const glm::vec3 &eye,
+    const glm::vec3 &dir,
+    const std::pair<float, float> &rng,
+    float &t,
+    float &beta,
+    float &gamma) const {
+    return hitTriangle(va.p, ba, ca, isFinite(), eye, dir, rng, t, beta, gamma);
+}
+
 bool Triangle::intersect(
     const glm::vec3 &eye,
     const glm::vec3 &dir,
     HitRecord &hr,
     const std::pair<float, float> &rng) const {
-    // NB: ea is not normalized on purpose!
-    auto ea = va.p - eye;
-
-    // NB: these variable names are for ease of matching eqn (Cramers) from source material
-    float a = ba.x, b = ba.y, c = ba.z,
-          d = ca.x, e = ca.y, f = ca.z,
-          g = dir.x, h = dir.y, i = dir.z;
-    float j = ea.x, k = ea.y, l = ea.z;
-
-    float M = a*(e*i-h*f) + b*(g*f-d*i) + c*(d*h-e*g);
-    if (glm::abs(M) < EPS)
-        return false;
-
-    float t = -(f*(a*k-j*b) + e*(j*c-a*l) + d*(b*l-k*c)) / M;
-    if (t < rng.first || t > rng.second)
-        return false;
-
-    float gamma = (i*(a*k-j*b) + h*(j*c-a*l) + g*(b*l-k*c)) / M;
-    if (isFinite() && (gamma < 0 || gamma > 1))
-        return false;
-
-    float beta = (j*(e*i-h*f) + k*(g*f-d*i) + l*(d*h-e*g)) / M;
-    if (isFinite() && (beta < 0 || beta > (1 - gamma)))
+    float t, beta, gamma;
+    if (!hit(eye, dir, rng, t, beta, gamma))
         return false;
 
     // Assign t iff smaller than current t (intersect closer)
     if (t < hr.t) {
         hr.t = t;
         hr.surf = this;
-        hr.norm = getNorm(glm::vec3(1 - gamma - beta, beta, gamma));
-        hr.uv = getUV(glm::vec3(1 - gamma - beta, beta, gamma));
+        hr.inst = nullptr;
+        hr.bary = glm::vec2(beta, gamma);
         return true;
     }
     return false;
 }
 
+bool Triangle::occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const {
+    float t, beta, gamma;
+    return hit(eye, dir, std::make_pair(0.0f, tmax), t, beta, gamma);
+}
+
+void Triangle::finalize(HitRecord &hr) const {
+    auto bary = glm::vec3(1 - hr.bary.x - hr.bary.y, hr.bary.x, hr.bary.y);
+    hr.norm = getNorm(bary);
+    hr.uv = getUV(bary);
+    hr.mat = &getMaterial();
+}
+
+bool Triangle::getBounds(AABB &box) const {
+    box.update(va.p);
+    box.update(vb.p);
+    box.update(vc.p);
+    return true;
+}
+
 glm::vec3 Triangle::getNorm(const glm::vec3 &bary) const {
     return va.n*bary.x + vb.n*bary.y + vc.n*bary.z;
 }
@@ -7,6 +7,49 @@
 
 using std::shared_ptr;
 
+#define TRIANGLE_EPS 1e-6f
+
+// Ray/triangle test using Cramer's rule, with edges ba = a - b and ca = a - c
+// NB: Sets barycentrics of b and c (beta, gamma), bounds are ignored if not finite (planes)
+static inline bool hitTriangle(
+    const glm::vec3 &pa,
+    const glm::vec3 &ba,
+    const glm::vec3 &ca,
+    bool finite,
+    const glm::vec3 &eye,
+    const glm::vec3 &dir,
+    const std::pair<float, float> &rng,
+    float &t,
+    float &beta,
+    float &gamma)
+{
+    // NB: ea is not normalized on purpose!
+    auto ea = pa - eye;
+
+    // NB: these variable names are for ease of matching eqn (Cramers) from source material
+    float a = ba.x, b = ba.y, c = ba.z,
+          d = ca.x, e = ca.y, f = ca.z,
+          g = dir.x, h = dir.y, i = dir.z;
+    float j = ea.x, k = ea.y, l = ea.z;
+
+    float M = a*(e*i-h*f) + b*(g*f-d*i) + c*(d*h-e*g);
+    if (glm::abs(M) < TRIANGLE_EPS)
+        return false;
+
+    t = -(f*(a*k-j*b) + e*(j*c-a*l) + d*(b*l-k*c)) / M;
+    if (t < rng.first || t > rng.second)
+        return false;
+
+    gamma = (i*(a*k-j*b) + h*(j*c-a*l) + g*(b*l-k*c)) / M;
+    if (finite && (gamma < 0 || gamma > 1))
+        return false;
+
+    beta = (j*(e*i-h*f) + k*(g*f-d*i) + l*(d*h-e*g)) / M;
+    if (finite && (beta < 0 || beta > (1 - gamma)))
+        return false;
+    return true;
+}
+
 class Vertex {
 public:
     Vertex(glm::vec3 p, glm::vec3 n, glm::vec2 uv) :
@@ -31,14 +74,26 @@ public:
         const glm::vec3 &dir,
         HitRecord &hr,
         const std::pair<float, float> &rng) const;
+    bool occluded(const glm::vec3 &eye, const glm::vec3 &dir, float tmax) const;
+    virtual bool getBounds(AABB &box) const;
     virtual glm::vec3 getNorm(const glm::vec3 &p) const;
     virtual glm::vec2 getUV(const glm::vec3 &p) const;
+    void finalize(HitRecord &hr) const;
 public:
     const glm::vec3 centroid;
     const Vertex va, vb, vc;
 protected:
     // Basis vectors for triangle (avoid recalculating)
     glm::vec3 ba, ca;
+private:
+    // Ray/triangle test shared by intersect and occluded (barycentrics are for vb and vc)
+    bool hit(
+        const glm::vec3 &eye,
+        const glm::vec3 &dir,
+        const std::pair<float, float> &rng,
+        float &t,
+        float &beta,
+        float &gamma) const;
 };
 
 
@@ -48,6 +103,7 @@ public:
     Plane(Vertex a, Vertex b, Vertex c, MaterialPtr mat) : Triangle(a, b, c, mat) { }
     virtual ~Plane() { }
     bool isFinite() const { return false; }
+    bool getBounds(AABB &box) const { return false; }
     glm::vec3 getNorm(const glm::vec3 &p) const;
 
     // NB: UV is not supported
@@ -0,0 +1,336 @@
+#include "tripack.hpp"
+#include "mesh.hpp"
+
+#include <cmath>
+#include <limits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define TRIPACK_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+TriPack::TriPack() {
+    for (uint k = 0; k < TRIPACK_WIDTH; ++k) {
+        for (uint a = 0; a < 3; ++a) {
+            v0[a][k] = e1[a][k] = e2[a][k] = 0;
+        }
+        tri[k] = TRIPACK_EMPTY;
+    }
+}
+
+void TriPack::set(uint32_t lane, const Mesh &mesh, uint32_t t) {
+    const auto &a = mesh.pos(t, 0);
+    auto ba = mesh.pos(t, 1) - a, ca = mesh.pos(t, 2) - a;
+    for (uint k = 0; k < 3; ++k) {
+        v0[k][lane] = a[k];
+        e1[k][lane] = ba[k];
+        e2[k][lane] = ca[k];
+    }
+    tri[lane] = t;
+}
+
+// Scalar fallback (one lane at a time)
+static inline bool hitLane(
+    const TriPack &pk, uint k,
+    const glm::vec3 &eye, const glm::vec3 &dir,
+    float tmin, float tmax, float &t, float &u, float &v)
+{
+    glm::vec3 v0(pk.v0[0][k], pk.v0[1][k], pk.v0[2][k]),
+              e1(pk.e1[0][k], pk.e1[1][k], pk.e1[2][k]),
+              e2(pk.e2[0][k], pk.e2[1][k], pk.e2[2][k]);
+    auto pvec = glm::cross(dir, e2);
+    float det = glm::dot(e1, pvec);
+    if (std::abs(det) < TRIANGLE_EPS)
+        return false;
+
+    float inv = 1.0f / det;
+    auto tvec = eye - v0;
+    u = glm::dot(tvec, pvec) * inv;
+    if (u < 0 || u > 1)
+        return false;
+
+    auto qvec = glm::cross(tvec, e1);
+    v = glm::dot(dir, qvec) * inv;
+    if (v < 0 || u + v > 1)
+        return false;
+
+    t = glm::dot(e2, qvec) * inv;
+    return t > tmin && t < tmax;
+}
+
+static bool intersectScalar(
+    const TriPack *packs, uint32_t n,
+    const glm::vec3 &eye, const glm::vec3 &dir,
+    float tmin, float &tmax, uint32_t &tri, glm::vec2 &bary)
+{
+    bool hit = false;
+    for (uint32_t p = 0; p < n; ++p) {
+        for (uint k = 0; k < TRIPACK_WIDTH; ++k) {
+            float t, u, v;
+            if (hitLane(packs[p], k, eye, dir, tmin, tmax, t, u, v)) {
+                tmax = t;
+                tri = packs[p].tri[k];
+                bary = glm::vec2(u, v);
+                hit = true;
+            }
+        }
+    }
+    return hit;
+}
+
+static bool occludedScalar(
+    const TriPack *packs, uint32_t n,
+    const glm::vec3 &eye, const glm::vec3 &dir,
+    float tmax)
+{
+    for (uint32_t p = 0; p < n; ++p) {
+        for (uint k = 0; k < TRIPACK_WIDTH; ++k) {
+            float t, u, v;
+            if (hitLane(packs[p], k, eye, dir, 0, tmax, t, u, v))
+                return true;
+        }
+    }
+    return false;
+}
+
+#ifdef TRIPACK_X86
+// SSE, one pack (4 triangles) per iteration
+// NB: Returns the lane mask of hits within (tmin, tmax) and the t/u/v of every lane
+static inline int hitPackSse(
+    const TriPack &pk,
+    const __m128 o[3], const __m128 d[3],
+    __m128 tmin, __m128 tmax, __m128 &t, __m128 &u, __m128 &v)
+{
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), eps = _mm_set1_ps(TRIANGLE_EPS);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 e1x = _mm_load_ps(pk.e1[0]), e1y = _mm_load_ps(pk.e1[1]), e1z = _mm_load_ps(pk.e1[2]);
+    __m128 e2x = _mm_load_ps(pk.e2[0]), e2y = _mm_load_ps(pk.e2[1]), e2z = _mm_load_ps(pk.e2[2]);
+
+    // pvec = dir x e2
+    __m128 px = _mm_sub_ps(_mm_mul_ps(d[1], e2z), _mm_mul_ps(d[2], e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(d[2], e2x), _mm_mul_ps(d[0], e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(d[0], e2y), _mm_mul_ps(d[1], e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 inv = _mm_div_ps(one, det);
+
+    // tvec = eye - v0
+    __m128 tx = _mm_sub_ps(o[0], _mm_load_ps(pk.v0[0]));
+    __m128 ty = _mm_sub_ps(o[1], _mm_load_ps(pk.v0[1]));
+    __m128 tz = _mm_sub_ps(o[2], _mm_load_ps(pk.v0[2]));
+    u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv);
+
+    // qvec = tvec x e1
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], qx), _mm_mul_ps(d[1], qy)), _mm_mul_ps(d[2], qz)), inv);
+    t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+
+    __m128 mask = _mm_cmpge_ps(_mm_and_ps(det, absMask), eps);
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+    mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, tmin));
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(t, tmax));
+    return _mm_movemask_ps(mask);
+}
+
+// Pick the nearest lane out of the hit mask bits
+static inline void nearestLane(
+    int bits, const float *ts, const float *us, const float *vs, const uint32_t *tris,
+    float &tmax, uint32_t &tri, glm::vec2 &bary)
+{
+    for (uint k = 0; bits != 0; ++k, bits >>= 1) {
+        if ((bits & 1) && ts[k] < tmax) {
+            tmax = ts[k];
+            tri = tris[k];
+            bary = glm::vec2(us[k], vs[k]);
+        }
+    }
+}
+
+static bool intersectSse(
+    const TriPack *packs, uint32_t n,
+    const glm::vec3 &eye, const glm::vec3 &dir,
+    float tmin, float &tmax, uint32_t &tri, glm::vec2 &bary)
+{
+    const __m128 o[3] = { _mm_set1_ps(eye.x), _mm_set1_ps(eye.y), _mm_set1_ps(eye.z) };
+    const __m128 d[3] = { _mm_set1_ps(dir.x), _mm_set1_ps(dir.y), _mm_set1_ps(dir.z) };
+    const __m128 tminv = _mm_set1_ps(tmin);
+    bool hit = false;
+    for (uint32_t p = 0; p < n; ++p) {
+        __m128 t, u, v;
+        int bits = hitPackSse(packs[p], o, d, tminv, _mm_set1_ps(tmax), t, u, v);
+        if (bits == 0)
+            continue;
+
+        alignas(16) float ts[4], us[4], vs[4];
+        _mm_store_ps(ts, t);
+        _mm_store_ps(us, u);
+        _mm_store_ps(vs, v);
+        nearestLane(bits, ts, us, vs, packs[p].tri, tmax, tri, bary);
+        hit = true;
+    }
+    return hit;
+}
+
+static bool occludedSse(
+    const TriPack *packs, uint32_t n,
+    const glm::vec3 &eye, const glm::vec3 &dir,
+    float tmax)
+{
+    const __m128 o[3] = { _mm_set1_ps(eye.x), _mm_set1_ps(eye.y), _mm_set1_ps(eye.z) };
+    const __m128 d[3] = { _mm_set1_ps(dir.x), _mm_set1_ps(dir.y), _mm_set1_ps(dir.z) };
+    const __m128 tminv = _mm_setzero_ps(), tmaxv = _mm_set1_ps(tmax);
+    for (uint32_t p = 0; p < n; ++p) {
+        __m128 t, u, v;
+        if (hitPackSse(packs[p], o, d, tminv, tmaxv, t, u, v))
+            return true;
+    }
+    return false;
+}
+
+// AVX2, two packs (8 triangles) per iteration, an odd pack left over goes through SSE
+#define TRIPACK_AVX2 __attribute__((target("avx2")))
+
+TRIPACK_AVX2 static inline __m256 load2(const float *lo, const float *hi) {
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(lo)), _mm_load_ps(hi), 1);
+}
+
+TRIPACK_AVX2 static inline int hitPackAvx(
+    const TriPack &a, const TriPack &b,
+    const __m256 o[3], const __m256 d[3],
+    __m256 tmin, __m256 tmax, __m256 &t, __m256 &u, __m256 &v)
+{
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), eps = _mm256_set1_ps(TRIANGLE_EPS);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 e1x = load2(a.e1[0], b.e1[0]), e1y = load2(a.e1[1], b.e1[1]), e1z = load2(a.e1[2], b.e1[2]);
+    __m256 e2x = load2(a.e2[0], b.e2[0]), e2y = load2(a.e2[1], b.e2[1]), e2z = load2(a.e2[2], b.e2[2]);
+
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(d[1], e2z), _mm256_mul_ps(d[2], e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(d[2], e2x), _mm256_mul_ps(d[0], e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(d[0], e2y), _mm256_mul_ps(d[1], e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    __m256 inv = _mm256_div_ps(one, det);
+
+    __m256 tx = _mm256_sub_ps(o[0], load2(a.v0[0], b.v0[0]));
+    __m256 ty = _mm256_sub_ps(o[1], load2(a.v0[1], b.v0[1]));
+    __m256 tz = _mm256_sub_ps(o[2], load2(a.v0[2], b.v0[2]));
+    u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv);
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+    v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d[0], qx), _mm256_mul_ps(d[1], qy)), _mm256_mul_ps(d[2], qz)), inv);
+    t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv);
+
+    __m256 mask = _mm256_cmp_ps(_mm256_and_ps(det, absMask), eps, _CMP_GE_OQ);
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, tmin, _CMP_GT_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, tmax, _CMP_LT_OQ));
+    return _mm256_movemask_ps(mask);
+}
+
+TRIPACK_AVX2 static bool intersectAvx2(
+    const TriPack *packs, uint32_t n,
+    const glm::vec3 &eye, const glm::vec3 &dir,
+    float tmin, float &tmax, uint32_t &tri, glm::vec2 &bary)
+{
+    const __m256 o[3] = { _mm256_set1_ps(eye.x), _mm256_set1_ps(eye.y), _mm256_set1_ps(eye.z) };
+    const __m256 d[3] = { _mm256_set1_ps(dir.x), _mm256_set1_ps(dir.y), _mm256_set1_ps(dir.z) };
+    const __m256 tminv = _mm256_set1_ps(tmin);
+    bool hit = false;
+    uint32_t p = 0;
+    for (; p + 1 < n; p += 2) {
+        __m256 t, u, v;
+        int bits = hitPackAvx(packs[p], packs[p + 1], o, d, tminv, _mm256_set1_ps(tmax), t, u, v);
+        if (bits == 0)
+            continue;
+
+        alignas(32) float ts[8], us[8], vs[8];
+        _mm256_store_ps(ts, t);
+        _mm256_store_ps(us, u);
+        _mm256_store_ps(vs, v);
+        nearestLane(bits & 0xf, ts, us, vs, packs[p].tri, tmax, tri, bary);
+        nearestLane(bits >> 4, ts + 4, us + 4, vs + 4, packs[p + 1].tri, tmax, tri, bary);
+        hit = true;
+    }
+    if (p < n) {
+        hit |= intersectSse(packs + p, 1, eye, dir, tmin, tmax, tri, bary);
+    }
+    return hit;
+}
+
+TRIPACK_AVX2 static bool occludedAvx2(
+    const TriPack *packs, uint32_t n,
+    const glm::vec3 &eye, const glm::vec3 &dir,
+    float tmax)
+{
+    const __m256 o[3] = { _mm256_set1_ps(eye.x), _mm256_set1_ps(eye.y), _mm256_set1_ps(eye.z) };
+    const __m256 d[3] = { _mm256_set1_ps(dir.x), _mm256_set1_ps(dir.y), _mm256_set1_ps(dir.z) };
+    const __m256 tminv = _mm256_setzero_ps(), tmaxv = _mm256_set1_ps(tmax);
+    uint32_t p = 0;
+    for (; p + 1 < n; p += 2) {
+        __m256 t, u, v;
+        if (hitPackAvx(packs[p], packs[p + 1], o, d, tminv, tmaxv, t, u, v))
+            return true;
+    }
+    return p < n && occludedSse(packs + p, 1, eye, dir, tmax);
+}
+#endif
+
+static const TriPackKernel kernels[] = {
+    { "scalar", intersectScalar, occludedScalar },
+#ifdef TRIPACK_X86
+    { "sse", intersectSse, occludedSse },
+    { "avx2", intersectAvx2, occludedAvx2 },
+#endif
+};
+static const uint numKernels = sizeof(kernels) / sizeof(kernels[0]);
+
+static bool supported(const TriPackKernel &k) {
+#ifdef TRIPACK_X86
+    // NB: May run before main (static init), so make sure the cpu features are loaded
+    __builtin_cpu_init();
+    if (string(k.name) == "sse")
+        return __builtin_cpu_supports("sse2");
+    if (string(k.name) == "avx2")
+        return __builtin_cpu_supports("avx2");
+#endif
+    return true;
+}
+
+// NB: SSE rather than AVX2 by default, SAH leaves are only a pack or two so the wider kernel rarely
+// has a second pack to test and measured slower end to end (it does win on large leaves)
+static const TriPackKernel *defaultKernel() {
+    for (uint i = 0; i < numKernels; ++i) {
+        if (string(kernels[i].name) == "sse" && supported(kernels[i]))
+            return &kernels[i];
+    }
+    return &kernels[0];
+}
+
+static const TriPackKernel *selected = defaultKernel();
+
+const TriPackKernel &triPackKernel() {
+    return *selected;
+}
+
+bool setTriPackKernel(const string &name) {
+    if (name == "auto") {
+        selected = defaultKernel();
+        return true;
+    }
+
+    for (uint i = 0; i < numKernels; ++i) {
+        if (name == kernels[i].name && supported(kernels[i])) {
+            selected = &kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
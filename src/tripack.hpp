@@ -0,0 +1,50 @@
+#ifndef TRIPACK_H
+#define TRIPACK_H
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <string>
+
+class Mesh;
+
+#define TRIPACK_WIDTH 4
+#define TRIPACK_EMPTY 0xffffffffu
+
+// Up to TRIPACK_WIDTH triangles in SoA form, precomputed for Moller-Trumbore (v0, e1 = v1 - v0, e2 = v2 - v0)
+// NB: Unused lanes have zero edges (and tri TRIPACK_EMPTY) so they can never be hit
+struct alignas(16) TriPack {
+    TriPack();
+
+    // Copy triangle tri of mesh into lane
+    void set(uint32_t lane, const Mesh &mesh, uint32_t tri);
+
+    float v0[3][TRIPACK_WIDTH];
+    float e1[3][TRIPACK_WIDTH];
+    float e2[3][TRIPACK_WIDTH];
+    uint32_t tri[TRIPACK_WIDTH];
+};
+
+// Closest hit in packs [0, n) within (tmin, tmax), on a hit sets tmax, tri and bary (of v1 and v2)
+typedef bool (*TriPackIntersectFn)(
+    const TriPack *packs, uint32_t n,
+    const glm::vec3 &eye, const glm::vec3 &dir,
+    float tmin, float &tmax, uint32_t &tri, glm::vec2 &bary);
+
+// True if any triangle in packs [0, n) is hit within (0, tmax)
+typedef bool (*TriPackOccludedFn)(
+    const TriPack *packs, uint32_t n,
+    const glm::vec3 &eye, const glm::vec3 &dir,
+    float tmax);
+
+struct TriPackKernel {
+    const char *name;
+    TriPackIntersectFn intersect;
+    TriPackOccludedFn occluded;
+};
+
+// Kernel used by Bvh leaves, defaults to SSE if the CPU supports it (scalar otherwise)
+const TriPackKernel &triPackKernel();
+
+// Force a kernel (auto, scalar, sse, avx2), returns false if unknown or unsupported by this CPU
+bool setTriPackKernel(const std::string &name);
+#endif